@@ -19,18 +19,31 @@ limitations under the License.
 #include <float.h>
 #include <math.h>
 
+#include <algorithm>
+
 #include "gflags/gflags.h"
 #include "glog/logging.h"
+#include "parallel.h"
 #include "tree.h"
 
+DECLARE_int32(num_threads);
+
 DEFINE_string(loss_type, "exponential",
               "Loss type. Required: One of exponential, logistic.");
 
-float ComputeEta(float wgtd_error, float tree_size, float alpha) {
+BoostParams BoostParamsFromFlags() {
+  BoostParams params;
+  params.tree_params = TreeParamsFromFlags();
+  params.loss_type = FLAGS_loss_type;
+  return params;
+}
+
+float ComputeEta(const TreeContext& context, float wgtd_error, float tree_size,
+                 float alpha) {
   wgtd_error = fmax(wgtd_error, kTolerance);  // Helps with division by zero.
   const float error_term =
       (1 - wgtd_error) * exp(alpha) - wgtd_error * exp(-alpha);
-  const float complexity_penalty = ComplexityPenalty(tree_size);
+  const float complexity_penalty = ComplexityPenalty(context, tree_size);
   const float ratio = complexity_penalty / wgtd_error;
   float eta;
   if (fabs(error_term) <= 2 * complexity_penalty) {
@@ -43,22 +56,122 @@ float ComputeEta(float wgtd_error, float tree_size, float alpha) {
   return eta;
 }
 
-// TODO(usyed): examples is passed by non-const reference because the example
-// weights need to be changed. This is bad style.
-void AddTreeToModel(vector<Example>& examples, Model* model) {
-  // Initialize normalizer
-  static float normalizer;
-  if (model->empty()) {
-    if (FLAGS_loss_type == "exponential") {
-      normalizer = exp(1) * static_cast<float>(examples.size());
-    } else if (FLAGS_loss_type == "logistic") {
-      normalizer =
-          static_cast<float>(examples.size()) / (log(2) * (1 + exp(-1)));
-    } else {
-      LOG(FATAL) << "Unexpected loss type: " << FLAGS_loss_type;
+// Loss policies for DeepBoostTrainer::AddTreeWithLoss(). InitialNormalizer()
+// returns the normalizer of the initial example weights, and UpdateWeights()
+// updates the normalized example weights and the normalizer after the weight
+// of a tree has changed by eta, where the tree misclassifies the examples in
+// incorrect, whose total weight is wgtd_error. Neither reads any flags, so a
+// loss is chosen once per model, and adding one costs nothing per example.
+struct ExponentialLoss {
+  static float InitialNormalizer(int num_examples) {
+    return exp(1) * static_cast<float>(num_examples);
+  }
+
+  static void UpdateWeights(float eta, float /*wgtd_error*/,
+                            const ExampleSet& incorrect, float* normalizer,
+                            vector<Weight>* weights) {
+    // Each weight is multiplied by exp(-eta) if its example is classified
+    // correctly and by exp(eta) otherwise.
+    const float factors[2] = {static_cast<float>(exp(-eta)),
+                              static_cast<float>(exp(eta))};
+    Weight* weight = weights->data();
+    const int num_examples = weights->size();
+    // Summed in double, so that the rounding of the sum does not outweigh
+    // that of the weights themselves.
+    double sum = 0;
+    for (size_t word = 0; word < incorrect.size(); ++word) {
+      const uint64_t bits = incorrect[word];
+      const int size = std::min(64, num_examples - static_cast<int>(word) * 64);
+      Weight* word_weights = weight + word * 64;
+      for (int i = 0; i < size; ++i) {
+        word_weights[i] *= factors[(bits >> i) & 1];
+        sum += word_weights[i];
+      }
+    }
+    *normalizer = sum;
+    // The new sum could be computed from wgtd_error instead, but float error
+    // in that closed form would compound over the iterations, so the weights
+    // are renormalized from their actual sum in a second pass, as for the
+    // logistic loss.
+    for (int id = 0; id < num_examples; ++id) {
+      weight[id] /= sum;
+    }
+  }
+};
+
+struct LogisticLoss {
+  static float InitialNormalizer(int num_examples) {
+    return static_cast<float>(num_examples) / (M_LN2 * (1 + exp(-1)));
+  }
+
+  static void UpdateWeights(float eta, float /*wgtd_error*/,
+                            const ExampleSet& incorrect, float* normalizer,
+                            vector<Weight>* weights) {
+    const float old_normalizer = *normalizer;
+    // exp(u), where u is eta if the example is classified correctly and -eta
+    // otherwise.
+    const float exp_u[2] = {static_cast<float>(exp(eta)),
+                            static_cast<float>(exp(-eta))};
+    Weight* weight = weights->data();
+    const int num_examples = weights->size();
+    float sum = 0;
+    for (int word = 0; word < static_cast<int>(incorrect.size()); ++word) {
+      const uint64_t bits = incorrect[word];
+      const int size = std::min(64, num_examples - word * 64);
+      Weight* word_weights = weight + word * 64;
+      for (int i = 0; i < size; ++i) {
+        const float z = (1 - M_LN2 * word_weights[i] * old_normalizer) /
+                        (M_LN2 * word_weights[i] * old_normalizer);
+        word_weights[i] = 1 / (M_LN2 * (1 + z * exp_u[(bits >> i) & 1]));
+        sum += word_weights[i];
+      }
     }
+    *normalizer = sum;
+    for (int id = 0; id < num_examples; ++id) {
+      weight[id] /= sum;
+    }
+  }
+};
+
+DeepBoostTrainer::DeepBoostTrainer(const BoostParams& params,
+                                   const ColumnarDataset& data,
+                                   const ColumnIndex& index)
+    : index_(&index), data_(data) {
+  // The loss is chosen when a model is started. The normalizer of the context
+  // is the sum of the example weights before they were last normalized.
+  float normalizer;
+  if (params.loss_type == "exponential") {
+    add_tree_ = &DeepBoostTrainer::AddTreeWithLoss<ExponentialLoss>;
+    normalizer = ExponentialLoss::InitialNormalizer(data.num_examples);
+  } else if (params.loss_type == "logistic") {
+    add_tree_ = &DeepBoostTrainer::AddTreeWithLoss<LogisticLoss>;
+    normalizer = LogisticLoss::InitialNormalizer(data.num_examples);
+  } else {
+    LOG(FATAL) << "Unexpected loss type: " << params.loss_type;
   }
-  InitializeTreeData(examples, normalizer);
+  InitializeTreeContext(params.tree_params, data, normalizer, &context_);
+}
+
+DeepBoostTrainer::DeepBoostTrainer(const BoostParams& params,
+                                   const ColumnarDataset& data)
+    : DeepBoostTrainer(params, data, own_index_) {
+  MakeColumnIndex(params.tree_params, data, &own_index_);
+  DropBinnedValues(own_index_, &data_);
+}
+
+void DeepBoostTrainer::AddTree() { (this->*add_tree_)(); }
+
+void DeepBoostTrainer::SetRegularization(double beta, double lambda) {
+  // The Rademacher complexities of the context do not depend on beta or
+  // lambda, so nothing else needs to be recomputed.
+  context_.params.beta = beta;
+  context_.params.lambda = lambda;
+}
+
+template <class Loss>
+void DeepBoostTrainer::AddTreeWithLoss() {
+  ColumnarDataset* data = &data_;
+  Model* model = &model_;
   int best_old_tree_idx = -1;
   float best_wgtd_error, wgtd_error, gradient, best_gradient = 0;
 
@@ -68,9 +181,10 @@ void AddTreeToModel(vector<Example>& examples, Model* model) {
     const float alpha = (*model)[i].first;
     if (fabs(alpha) < kTolerance) continue;  // Skip zeroed-out weights.
     const Tree& old_tree = (*model)[i].second;
-    wgtd_error = EvaluateTreeWgtd(examples, old_tree);
+    wgtd_error = EvaluateTreeWgtd(incorrect_sets_[i], data->weights);
     int sign_edge = (wgtd_error >= 0.5) ? 1 : -1;
-    gradient = Gradient(wgtd_error, old_tree.size(), alpha, sign_edge);
+    gradient = Gradient(context_, wgtd_error, old_tree.size(), alpha,
+                        sign_edge);
     if (fabs(gradient) >= fabs(best_gradient)) {
       best_gradient = gradient;
       best_wgtd_error = wgtd_error;
@@ -80,10 +194,12 @@ void AddTreeToModel(vector<Example>& examples, Model* model) {
   }
 
   // Find best new tree
-  Tree new_tree = TrainTree(examples);
-  wgtd_error = EvaluateTreeWgtd(examples, new_tree);
-  gradient = Gradient(wgtd_error, new_tree.size(), 0, -1);
-  if (model->empty() || fabs(gradient) > fabs(best_gradient)) {
+  Tree new_tree = TrainTree(context_, *data, *index_, &partition_);
+  ExampleSet new_incorrect_set;
+  MakeIncorrectSet(*data, new_tree, partition_, &new_incorrect_set);
+  wgtd_error = EvaluateTreeWgtd(new_incorrect_set, data->weights);
+  gradient = Gradient(context_, wgtd_error, new_tree.size(), 0, -1);
+  if (!old_tree_is_best || fabs(gradient) > fabs(best_gradient)) {
     best_gradient = gradient;
     best_wgtd_error = wgtd_error;
     old_tree_is_best = false;
@@ -91,43 +207,28 @@ void AddTreeToModel(vector<Example>& examples, Model* model) {
 
   // Update model weights
   float alpha;
-  const Tree* tree;
+  int tree_size;
   if (old_tree_is_best) {
     alpha = (*model)[best_old_tree_idx].first;
-    tree = &((*model)[best_old_tree_idx].second);
+    tree_size = (*model)[best_old_tree_idx].second.size();
   } else {
     alpha = 0;
-    tree = &(new_tree);
+    tree_size = new_tree.size();
   }
-  const float eta = ComputeEta(best_wgtd_error, tree->size(), alpha);
+  const float eta = ComputeEta(context_, best_wgtd_error, tree_size, alpha);
   if (old_tree_is_best) {
     (*model)[best_old_tree_idx].first += eta;
   } else {
-    model->push_back(make_pair(eta, new_tree));
+    model->push_back(make_pair(eta, std::move(new_tree)));
+    incorrect_sets_.push_back(std::move(new_incorrect_set));
   }
+  // The examples the selected tree misclassifies.
+  const ExampleSet& incorrect =
+      incorrect_sets_[old_tree_is_best ? best_old_tree_idx : model->size() - 1];
 
-  // Update examples weights and compute normalizer
-  const float old_normalizer = normalizer;
-  normalizer = 0;
-  for (Example& example : examples) {
-    const float u = eta * example.label * ClassifyExample(example, *tree);
-    if (FLAGS_loss_type == "exponential") {
-      example.weight *= exp(-u);
-    } else if (FLAGS_loss_type == "logistic") {
-      const float z = (1 - log(2) * example.weight * old_normalizer) /
-                      (log(2) * example.weight * old_normalizer);
-      example.weight = 1 / (log(2) * (1 + z * exp(u)));
-    } else {
-      LOG(FATAL) << "Unexpected loss type: " << FLAGS_loss_type;
-    }
-    normalizer += example.weight;
-  }
-
-  // Renormalize example weights
-  // TODO(usyed): Two loops is inefficient.
-  for (Example& example : examples) {
-    example.weight /= normalizer;
-  }
+  // Update examples weights and normalizer
+  Loss::UpdateWeights(eta, best_wgtd_error, incorrect, &context_.normalizer,
+                      &data->weights);
   ///*
   LOG(INFO) << "Tree " << model->size() + 1 
           << ": weighted error = " << wgtd_error
@@ -135,26 +236,201 @@ void AddTreeToModel(vector<Example>& examples, Model* model) {
   //*/
 }
 
-Label ClassifyExample(const Example& example, const Model& model) {
+void PackModel(const Model& model, PackedModel* packed_model) {
+  packed_model->weights.clear();
+  packed_model->roots.clear();
+  packed_model->nodes.clear();
+  for (const pair<Weight, Tree>& wgtd_tree : model) {
+    packed_model->weights.push_back(wgtd_tree.first);
+    packed_model->roots.push_back(packed_model->nodes.size());
+    PackTree(wgtd_tree.second, &packed_model->nodes);
+  }
+}
+
+float ScoreExample(const Example& example, const PackedModel& packed_model) {
+  const PackedNode* nodes = packed_model.nodes.data();
+  float score = 0;
+  for (size_t i = 0; i < packed_model.weights.size(); ++i) {
+    score += packed_model.weights[i] *
+             ClassifyExample(example, nodes + packed_model.roots[i]);
+  }
+  return score;
+}
+
+int ModelDepth(const Model& model) {
+  int depth = 0;
+  for (const pair<Weight, Tree>& wgtd_tree : model) {
+    depth = std::max(depth, TreeDepth(wgtd_tree.second));
+  }
+  return depth;
+}
+
+void MakeHeapModel(const Model& model, HeapModel* heap_model) {
+  heap_model->depth = ModelDepth(model);
+  heap_model->weights.clear();
+  heap_model->split_features.clear();
+  heap_model->split_values.clear();
+  heap_model->leaf_labels.clear();
+  for (const pair<Weight, Tree>& wgtd_tree : model) {
+    AppendHeapTree(wgtd_tree.second, wgtd_tree.first, heap_model);
+  }
+}
+
+// Examples go through the trees in blocks of this many, small enough for
+// their slots and feature values to stay in L1 while they do.
+static const int kExampleBlockSize = 256;
+
+// Add to scores[j] the weighted predictions of trees tree_begin, ...,
+// tree_end - 1 of heap_model on the example with feature values rows[j], for
+// every j < num_rows <= kExampleBlockSize, tree by tree.
+template <class Score>
+static void AddHeapTreeScores(const HeapModel& heap_model, int tree_begin,
+                              int tree_end, const Value* const* rows,
+                              int num_rows, Score* scores) {
+  const int depth = heap_model.depth;
+  const int num_splits = (1 << depth) - 1, num_leaves = 1 << depth;
+  int slots[kExampleBlockSize];
+  for (int i = tree_begin; i < tree_end; ++i) {
+    const Feature* split_features =
+        heap_model.split_features.data() + i * num_splits;
+    const Value* split_values = heap_model.split_values.data() + i * num_splits;
+    const Value* leaf_labels = heap_model.leaf_labels.data() + i * num_leaves;
+    std::fill(slots, slots + num_rows, 0);
+    for (int level = 0; level < depth; ++level) {
+      for (int j = 0; j < num_rows; ++j) {
+        const int slot = slots[j];
+        // NaN values go right, as in ClassifyExample().
+        slots[j] = 2 * slot + 1 +
+                   !(rows[j][split_features[slot]] <= split_values[slot]);
+      }
+    }
+    const Weight weight = heap_model.weights[i];
+    for (int j = 0; j < num_rows; ++j) {
+      scores[j] += weight * leaf_labels[slots[j] - num_splits];
+    }
+  }
+}
+
+// Add to scores[j] the weighted prediction of each tree of heap_model on
+// examples[j], tree by tree.
+template <class Score>
+static void AddHeapModelScores(const vector<Example>& examples,
+                               const HeapModel& heap_model, Score* scores) {
+  const Value* rows[kExampleBlockSize];
+  const int num_examples = examples.size();
+  for (int begin = 0; begin < num_examples; begin += kExampleBlockSize) {
+    const int size = std::min<int>(kExampleBlockSize, num_examples - begin);
+    for (int j = 0; j < size; ++j) rows[j] = examples[begin + j].values.data();
+    AddHeapTreeScores(heap_model, 0, heap_model.weights.size(), rows, size,
+                      scores + begin);
+  }
+}
+
+void ScoreExamples(const vector<Example>& examples,
+                   const HeapModel& heap_model, vector<float>* scores) {
+  scores->assign(examples.size(), 0);
+  AddHeapModelScores(examples, heap_model, scores->data());
+}
+
+void MakeFeatureMatrix(const vector<Example>& examples, FeatureMatrix* matrix) {
+  matrix->num_rows = examples.size();
+  matrix->num_features = examples.empty() ? 0 : examples[0].values.size();
+  matrix->values.clear();
+  matrix->values.reserve(static_cast<size_t>(matrix->num_rows) *
+                         matrix->num_features);
+  for (const Example& example : examples) {
+    CHECK_EQ(static_cast<int>(example.values.size()), matrix->num_features);
+    matrix->values.insert(matrix->values.end(), example.values.begin(),
+                          example.values.end());
+  }
+}
+
+// ScoreBatch() gives each thread chunks of this many rows at a time, and
+// applies the trees to a chunk in blocks of about this many bytes of the
+// laid-out model, which stay in L2 while the rows of the chunk go through them.
+static const int kRowChunkSize = 16 * kExampleBlockSize;
+static const int kTreeBlockBytes = 64 * 1024;
+
+void ScoreBatch(const FeatureMatrix& matrix, const Model& model, float* out) {
+  ScoreBatch(matrix, model, FLAGS_num_threads, out);
+}
+
+void ScoreBatch(const FeatureMatrix& matrix, const Model& model,
+                int num_threads, float* out) {
+  std::fill(out, out + matrix.num_rows, 0);
+  const int num_trees = model.size();
+  const int num_chunks = (matrix.num_rows + kRowChunkSize - 1) / kRowChunkSize;
+  if (ModelDepth(model) <= kMaxHeapTreeDepth) {
+    HeapModel heap_model;
+    MakeHeapModel(model, &heap_model);
+    const int num_leaves = 1 << heap_model.depth;
+    const int tree_bytes =
+        (num_leaves - 1) * (sizeof(Feature) + sizeof(Value)) +
+        num_leaves * sizeof(Value);
+    const int tree_block_size = std::max(1, kTreeBlockBytes / tree_bytes);
+    ParallelFor(0, num_chunks, num_threads, [&](int chunk) {
+      const int chunk_begin = chunk * kRowChunkSize;
+      const int chunk_end =
+          std::min(matrix.num_rows, chunk_begin + kRowChunkSize);
+      const Value* rows[kExampleBlockSize];
+      for (int tree_begin = 0; tree_begin < num_trees;
+           tree_begin += tree_block_size) {
+        const int tree_end = std::min(num_trees, tree_begin + tree_block_size);
+        for (int begin = chunk_begin; begin < chunk_end;
+             begin += kExampleBlockSize) {
+          const int size = std::min(kExampleBlockSize, chunk_end - begin);
+          for (int j = 0; j < size; ++j) rows[j] = matrix.row(begin + j);
+          AddHeapTreeScores(heap_model, tree_begin, tree_end, rows, size,
+                            out + begin);
+        }
+      }
+    });
+  } else {
+    PackedModel packed_model;
+    PackModel(model, &packed_model);
+    const PackedNode* nodes = packed_model.nodes.data();
+    const int tree_bytes =
+        sizeof(PackedNode) * packed_model.nodes.size() / num_trees;
+    const int tree_block_size = std::max(1, kTreeBlockBytes / tree_bytes);
+    ParallelFor(0, num_chunks, num_threads, [&](int chunk) {
+      const int chunk_begin = chunk * kRowChunkSize;
+      const int chunk_end =
+          std::min(matrix.num_rows, chunk_begin + kRowChunkSize);
+      for (int tree_begin = 0; tree_begin < num_trees;
+           tree_begin += tree_block_size) {
+        const int tree_end = std::min(num_trees, tree_begin + tree_block_size);
+        for (int row = chunk_begin; row < chunk_end; ++row) {
+          const Value* values = matrix.row(row);
+          for (int i = tree_begin; i < tree_end; ++i) {
+            out[row] += packed_model.weights[i] *
+                        ClassifyExample(values, nodes + packed_model.roots[i]);
+          }
+        }
+      }
+    });
+  }
+}
+
+float ScoreExample(const Example& example, const Model& model) {
   float score = 0;
   for (const pair<Weight, Tree>& wgtd_tree : model) {
     score += wgtd_tree.first * ClassifyExample(example, wgtd_tree.second);
   }
-  if (score < 0) {
+  return score;
+}
+
+Label ClassifyExample(const Example& example, const Model& model) {
+  if (ScoreExample(example, model) < 0) {
     return -1;
   } else {
     return 1;
   }
 }
 
-void EvaluateModel(const vector<Example>& examples, const Model& model,
-                   float* error, float* avg_tree_size, int* num_trees) {
-  float incorrect = 0;
-  for (const Example& example : examples) {
-    if (example.label != ClassifyExample(example, model)) {
-      ++incorrect;
-    }
-  }
+// Set num_trees to the number of trees of model with non-zero weight, and
+// avg_tree_size to their average size.
+static void CountTrees(const Model& model, float* avg_tree_size,
+                       int* num_trees) {
   *num_trees = 0;
   int sum_tree_size = 0;
   for (const pair<Weight, Tree>& wgtd_tree : model) {
@@ -163,6 +439,175 @@ void EvaluateModel(const vector<Example>& examples, const Model& model,
       sum_tree_size += wgtd_tree.second.size();
     }
   }
-  *error = (incorrect / examples.size());
   *avg_tree_size = static_cast<float>(sum_tree_size) / *num_trees;
 }
+
+void EvaluateModel(const vector<Example>& examples, const Model& model,
+                   float* error, float* avg_tree_size, int* num_trees) {
+  // Classified as by ClassifyExample(), with the model laid out once, in heap
+  // order unless its trees are too deep for it.
+  vector<float> scores;
+  if (ModelDepth(model) <= kMaxHeapTreeDepth) {
+    HeapModel heap_model;
+    MakeHeapModel(model, &heap_model);
+    ScoreExamples(examples, heap_model, &scores);
+  } else {
+    PackedModel packed_model;
+    PackModel(model, &packed_model);
+    for (const Example& example : examples) {
+      scores.push_back(ScoreExample(example, packed_model));
+    }
+  }
+  float incorrect = 0;
+  for (size_t j = 0; j < examples.size(); ++j) {
+    const Label label = scores[j] < 0 ? -1 : 1;
+    if (examples[j].label != label) {
+      ++incorrect;
+    }
+  }
+  CountTrees(model, avg_tree_size, num_trees);
+  *error = (incorrect / examples.size());
+}
+
+void EvaluateModel(const vector<Example>& examples, const Model& model,
+                   MarginCache* margin_cache, float* error,
+                   float* avg_tree_size, int* num_trees) {
+  vector<double>& margins = margin_cache->margins;
+  vector<Weight>& tree_weights = margin_cache->tree_weights;
+  margins.resize(examples.size(), 0);
+  CHECK_LE(tree_weights.size(), model.size());
+  tree_weights.resize(model.size(), 0);
+  // The trees whose weights changed, weighted by the change, are laid out in
+  // heap order unless they are too deep for it.
+  vector<int> changed_trees;
+  vector<Weight> delta_weights;
+  int depth = 0;
+  for (size_t i = 0; i < model.size(); ++i) {
+    const Weight delta_weight = model[i].first - tree_weights[i];
+    if (delta_weight == 0) continue;
+    changed_trees.push_back(i);
+    delta_weights.push_back(delta_weight);
+    depth = std::max(depth, TreeDepth(model[i].second));
+  }
+  if (depth <= kMaxHeapTreeDepth) {
+    HeapModel changes;
+    changes.depth = depth;
+    for (size_t k = 0; k < changed_trees.size(); ++k) {
+      AppendHeapTree(model[changed_trees[k]].second, delta_weights[k],
+                     &changes);
+    }
+    AddHeapModelScores(examples, changes, margins.data());
+  } else {
+    vector<PackedNode> packed_tree;
+    for (size_t k = 0; k < changed_trees.size(); ++k) {
+      packed_tree.clear();
+      PackTree(model[changed_trees[k]].second, &packed_tree);
+      for (size_t j = 0; j < examples.size(); ++j) {
+        margins[j] += delta_weights[k] * ClassifyExample(examples[j],
+                                                         packed_tree.data());
+      }
+    }
+  }
+  for (int i : changed_trees) tree_weights[i] = model[i].first;
+  // Scores are classified as in ClassifyExample(), but are summed in double
+  // precision in a different order, so a score within rounding error of zero
+  // may get a different label.
+  float incorrect = 0;
+  for (size_t j = 0; j < examples.size(); ++j) {
+    const Label label = (margins[j] < 0) ? -1 : 1;
+    if (examples[j].label != label) {
+      ++incorrect;
+    }
+  }
+  CountTrees(model, avg_tree_size, num_trees);
+  *error = (incorrect / examples.size());
+}
+
+void RecordModelUpdate(const vector<Weight>& old_tree_weights,
+                       const Model& model, ModelHistory* history) {
+  CHECK_LE(old_tree_weights.size(), model.size());
+  ModelUpdate update = {-1, 0, 0};
+  for (size_t i = 0; i < model.size(); ++i) {
+    const Weight old_weight =
+        (i < old_tree_weights.size()) ? old_tree_weights[i] : 0;
+    if (i >= old_tree_weights.size() || model[i].first != old_weight) {
+      update.tree_index = i;
+      update.delta_weight = model[i].first - old_weight;
+      update.weight = model[i].first;
+      break;
+    }
+  }
+  history->push_back(update);
+}
+
+void GetTreeWeights(const Model& model, vector<Weight>* tree_weights) {
+  tree_weights->clear();
+  for (const pair<Weight, Tree>& wgtd_tree : model) {
+    tree_weights->push_back(wgtd_tree.first);
+  }
+}
+
+void RestoreModel(const vector<Weight>& tree_weights, Model* model) {
+  CHECK_LE(tree_weights.size(), model->size());
+  model->erase(model->begin() + tree_weights.size(), model->end());
+  for (size_t i = 0; i < model->size(); ++i) {
+    (*model)[i].first = tree_weights[i];
+  }
+}
+
+void EvaluateModelHistory(const vector<Example>& examples, const Model& model,
+                          const ModelHistory& history, vector<float>* errors) {
+  vector<int> num_incorrect(history.size(), 0);
+  vector<Label> predictions(model.size());
+  PackedModel packed_model;
+  PackModel(model, &packed_model);
+  const PackedNode* nodes = packed_model.nodes.data();
+  for (const Example& example : examples) {
+    for (size_t i = 0; i < model.size(); ++i) {
+      predictions[i] =
+          ClassifyExample(example, nodes + packed_model.roots[i]);
+    }
+    // The margin is built up in the same order as by a MarginCache updated
+    // after every iteration.
+    double margin = 0;
+    for (size_t k = 0; k < history.size(); ++k) {
+      const ModelUpdate& update = history[k];
+      if (update.tree_index >= 0) {
+        margin += update.delta_weight * predictions[update.tree_index];
+      }
+      const Label label = (margin < 0) ? -1 : 1;
+      if (example.label != label) ++num_incorrect[k];
+    }
+  }
+  errors->resize(history.size());
+  for (size_t k = 0; k < history.size(); ++k) {
+    (*errors)[k] = static_cast<float>(num_incorrect[k]) / examples.size();
+  }
+}
+
+void CountTreesHistory(const Model& model, const ModelHistory& history,
+                       vector<float>* avg_tree_sizes, vector<int>* num_trees) {
+  vector<Weight> tree_weights(model.size(), 0);
+  int num_nonzero_trees = 0, sum_tree_size = 0;
+  avg_tree_sizes->resize(history.size());
+  num_trees->resize(history.size());
+  for (size_t k = 0; k < history.size(); ++k) {
+    const ModelUpdate& update = history[k];
+    if (update.tree_index >= 0) {
+      const int tree_size = model[update.tree_index].second.size();
+      Weight& weight = tree_weights[update.tree_index];
+      if (fabs(weight) >= kTolerance) {
+        --num_nonzero_trees;
+        sum_tree_size -= tree_size;
+      }
+      weight = update.weight;
+      if (fabs(weight) >= kTolerance) {
+        ++num_nonzero_trees;
+        sum_tree_size += tree_size;
+      }
+    }
+    (*num_trees)[k] = num_nonzero_trees;
+    (*avg_tree_sizes)[k] =
+        static_cast<float>(sum_tree_size) / num_nonzero_trees;
+  }
+}
@@ -17,13 +17,109 @@ limitations under the License.
 #ifndef BOOST_H_
 #define BOOST_H_
 
+#include "tree.h"
 #include "types.h"
 
-// Either add a new tree to model or update the weight of an existing tree in
-// model. The tree and weight are selected via approximate coordinate descent on
-// the objective, where the "approximate" indicates that we do not search all
-// trees but instead grow trees greedily.
-void AddTreeToModel(vector<Example>& examples, Model* model);
+// The hyperparameters of training a model. See the flags of the same names.
+typedef struct BoostParams {
+  TreeParams tree_params;
+  string loss_type;
+} BoostParams;
+
+// Return the boost params given by the flags.
+BoostParams BoostParamsFromFlags();
+
+// Trains one model on one data set. A trainer owns the model, the example
+// weights and everything else that changes during training, so several models
+// can be trained at the same time, in different threads, on the same data.
+class DeepBoostTrainer {
+ public:
+  // Train a model on data with params. The trainer keeps a copy of data, which
+  // shares its values with data. index must be the column index of data built
+  // with params.tree_params, and must outlive the trainer.
+  DeepBoostTrainer(const BoostParams& params, const ColumnarDataset& data,
+                   const ColumnIndex& index);
+
+  // Same as above, but builds the column index of data itself. In histogram
+  // mode, the trainer's copy of data then drops its share of the values.
+  DeepBoostTrainer(const BoostParams& params, const ColumnarDataset& data);
+
+  DeepBoostTrainer(const DeepBoostTrainer&) = delete;
+  DeepBoostTrainer& operator=(const DeepBoostTrainer&) = delete;
+
+  // Either add a new tree to the model or update the weight of an existing tree
+  // in the model. The tree and weight are selected via approximate coordinate
+  // descent on the objective, where the "approximate" indicates that we do not
+  // search all trees but instead grow trees greedily. The example weights are
+  // updated accordingly.
+  void AddTree();
+
+  // Change beta and lambda of the model. Training goes on from the model and
+  // example weights as they are, which warm-starts the next model along a
+  // regularization path: AddTree() weighs the trees already in the model
+  // against the new complexity penalties, and may reweight or zero them out.
+  void SetRegularization(double beta, double lambda);
+
+  // The model trained so far.
+  const Model& model() const { return model_; }
+
+  // The current weights of the examples of the data, which sum to 1.
+  const vector<Weight>& weights() const { return data_.weights; }
+
+ private:
+  template <class Loss>
+  void AddTreeWithLoss();
+
+  ColumnIndex own_index_;  // Used if no index was given.
+  const ColumnIndex* index_;
+  ColumnarDataset data_;
+  TreeContext context_;
+  // Reused by every tree grown, so that the trainer allocates it only once.
+  ExamplePartition partition_;
+  Model model_;
+  // incorrect_sets_[i] is the set of training examples that tree i of the
+  // model misclassifies. The labels of the training examples never change, so
+  // this is computed once per tree.
+  vector<ExampleSet> incorrect_sets_;
+  // AddTreeWithLoss() for the loss of the model.
+  void (DeepBoostTrainer::*add_tree_)();
+};
+
+// Set packed_model to the trees of model, packed for classifying examples.
+void PackModel(const Model& model, PackedModel* packed_model);
+
+// Same as ScoreExample() below, with model packed into packed_model.
+float ScoreExample(const Example& example, const PackedModel& packed_model);
+
+// Return the depth of the deepest tree of model, or 0 if it has none.
+int ModelDepth(const Model& model);
+
+// Set heap_model to model laid out in heap order. ModelDepth(model) must be at
+// most kMaxHeapTreeDepth.
+void MakeHeapModel(const Model& model, HeapModel* heap_model);
+
+// Set scores[j] to ScoreExample() of examples[j], with the model laid out in
+// heap_model. Each tree is applied to a block of examples at a time, one level
+// at a time, with no branches that depend on the examples.
+void ScoreExamples(const vector<Example>& examples,
+                   const HeapModel& heap_model, vector<float>* scores);
+
+// Store examples row by row in matrix.
+void MakeFeatureMatrix(const vector<Example>& examples, FeatureMatrix* matrix);
+
+// Set out[row] to ScoreExample() of the example in row of matrix, for every
+// row. The model is laid out once, as by EvaluateModel(), and its trees are
+// applied in blocks small enough to stay in cache while blocks of rows stream
+// through them. The rows are spread over num_threads threads.
+void ScoreBatch(const FeatureMatrix& matrix, const Model& model,
+                int num_threads, float* out);
+
+// Same as above, with the number of threads given by the num_threads flag.
+void ScoreBatch(const FeatureMatrix& matrix, const Model& model, float* out);
+
+// Return the score of example under model, i.e., the weighted sum of the
+// predictions of its trees. Its sign is the label model predicts.
+float ScoreExample(const Example& example, const Model& model);
 
 // Classify example with model.
 Label ClassifyExample(const Example& example, const Model& model);
@@ -33,8 +129,61 @@ Label ClassifyExample(const Example& example, const Model& model);
 void EvaluateModel(const vector<Example>& examples, const Model& model,
                    float* error, float* avg_tree_size, int* num_trees);
 
+// The scores of a fixed set of examples under a model, i.e., the weighted sums
+// of the predictions of its trees. Kept up to date by EvaluateModel() as the
+// model changes, by adding in only the trees whose weights changed.
+typedef struct MarginCache {
+  vector<double> margins;
+  // The weight of each tree of the model that margins includes.
+  vector<Weight> tree_weights;
+} MarginCache;
+
+// Same as above, but uses and updates margin_cache, which must have been used
+// only with examples and earlier versions of model, i.e., model may only have
+// had trees added or reweighted since. A new model needs a new cache.
+void EvaluateModel(const vector<Example>& examples, const Model& model,
+                   MarginCache* margin_cache, float* error,
+                   float* avg_tree_size, int* num_trees);
+
+// The change made to a model by one call to DeepBoostTrainer::AddTree(): the
+// weight of tree tree_index was changed by delta_weight to weight. A new tree
+// counts as having had weight 0. tree_index is -1 if no weight changed.
+typedef struct ModelUpdate {
+  int tree_index;
+  Weight delta_weight;
+  Weight weight;
+} ModelUpdate;
+
+// The updates that built a model, in order. Replaying the first k updates
+// gives the model after k iterations.
+typedef vector<ModelUpdate> ModelHistory;
+
+// Append to history the update that changed a model whose trees had weights
+// old_tree_weights into model.
+void RecordModelUpdate(const vector<Weight>& old_tree_weights,
+                       const Model& model, ModelHistory* history);
+
+// Set errors[k] to the error on examples of the model after the first k + 1
+// updates of history, where model is the model after all of them. Each tree is
+// applied to each example once, no matter how often it was reweighted.
+void EvaluateModelHistory(const vector<Example>& examples, const Model& model,
+                          const ModelHistory& history, vector<float>* errors);
+
+// Set num_trees[k] and avg_tree_sizes[k] to the number of trees with non-zero
+// weight and their average size after the first k + 1 updates of history.
+void CountTreesHistory(const Model& model, const ModelHistory& history,
+                       vector<float>* avg_tree_sizes, vector<int>* num_trees);
+
+// Set tree_weights to the weights of the trees of model.
+void GetTreeWeights(const Model& model, vector<Weight>* tree_weights);
+
+// Undo the changes made to model since its trees had weights tree_weights,
+// i.e., remove the trees added since and restore the weights of the others.
+void RestoreModel(const vector<Weight>& tree_weights, Model* model);
+
 // Return the optimal weight to add to a tree that will maximally decrease the
 // objective.
-float ComputeEta(float wgtd_error, float tree_size, float alpha);
+float ComputeEta(const TreeContext& context, float wgtd_error, float tree_size,
+                 float alpha);
 
 #endif  // BOOST_H_
@@ -16,6 +16,9 @@ limitations under the License.
 
 #include <math.h>
 
+#include <limits>
+#include <thread>
+
 #include "boost.h"
 #include "tree.h"  // TODO(usyed): Figure out how not to have to include this.
 #include "srm_test.h"
@@ -32,8 +35,42 @@ class BoostTest : public SrmTest {
  protected:
   virtual void SetUp() {
     SrmTest::SetUp();
-    InitializeTreeData(examples_, examples_.size());
+    MakeColumnarDataset(examples_, &data_);
+  }
+
+  // Return the context of data_ with the tree params given by the flags.
+  TreeContext Context() {
+    TreeContext context;
+    InitializeTreeContext(TreeParamsFromFlags(), data_, data_.num_examples,
+                          &context);
+    return context;
   }
+
+  // Set examples to num_examples examples of two features, with labels that
+  // take trees of depth 3 to separate, and return a model of 5 trees of depth
+  // at most 3 trained on them.
+  Model TrainModelOfDepthThree(int num_examples, vector<Example>* examples) {
+    examples->resize(num_examples);
+    for (int i = 0; i < num_examples; ++i) {
+      Example& example = (*examples)[i];
+      example.values = {static_cast<Value>(i % 13), static_cast<Value>(i % 7)};
+      example.label = (i % 13 < 6) != (i % 7 == 0) ? 1 : -1;
+      example.weight = 1.0 / num_examples;
+    }
+    ColumnarDataset data;
+    MakeColumnarDataset(*examples, &data);
+    FLAGS_tree_depth = 3;
+    FLAGS_beta = 0;
+    FLAGS_lambda = 0;
+    FLAGS_loss_type = "exponential";
+    DeepBoostTrainer trainer(BoostParamsFromFlags(), data);
+    for (int i = 0; i < 5; ++i) {
+      trainer.AddTree();
+    }
+    return trainer.model();
+  }
+
+  ColumnarDataset data_;
 };
 
 TEST_F(BoostTest, TestAddTreeToModel) {
@@ -41,10 +78,10 @@ TEST_F(BoostTest, TestAddTreeToModel) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_loss_type = "exponential";
-  Model model;
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
   // Train a model with a single tree. The tree's weighted error will be 0.2,
   // and it will only get example 3 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTree();
   // Every example is originally weighted equally.
   const float original_wgt = 0.2;
   // alpha = 0.5 * log((1 - error) / error), where error = 0.2.
@@ -54,15 +91,15 @@ TEST_F(BoostTest, TestAddTreeToModel) {
   // Adjust weights and normalize.
   float correct_wgt = original_wgt * exp(-alpha) / normalizer;
   float incorrect_wgt = original_wgt * exp(alpha) / normalizer;
-  EXPECT_NEAR(correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(incorrect_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(incorrect_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[4], kTolerance);
 
   // Add another tree to the model. The tree's weighted error will be 0.125, and
   // it will only get example 4 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTree();
   // alpha = 0.5 * log((1 - error) / error), where error = 0.125.
   alpha = 0.97295507452;
   // Normalizer is sum of all adjusted weights.
@@ -71,11 +108,100 @@ TEST_F(BoostTest, TestAddTreeToModel) {
   float both_correct_wgt = correct_wgt * exp(-alpha) / normalizer;
   float first_correct_wgt = correct_wgt * exp(alpha) / normalizer;
   float second_correct_wgt = incorrect_wgt * exp(-alpha) / normalizer;
-  EXPECT_NEAR(both_correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(second_correct_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(first_correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(second_correct_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(first_correct_wgt, trainer.weights()[4], kTolerance);
+}
+
+TEST_F(BoostTest, TestAddTreeToModelWeightsStayNormalized) {
+  FLAGS_tree_depth = 1;
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  for (const char* loss_type : {"exponential", "logistic"}) {
+    FLAGS_loss_type = loss_type;
+    DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+    for (int iter = 0; iter < 10; ++iter) {
+      trainer.AddTree();
+      float sum = 0;
+      for (Weight weight : trainer.weights()) {
+        EXPECT_LT(0, weight);
+        sum += weight;
+      }
+      EXPECT_NEAR(1, sum, kTolerance);
+    }
+  }
+  FLAGS_loss_type = "exponential";
+}
+
+TEST_F(BoostTest, TestAddTreeToModelWeightsStayNormalizedManyIterations) {
+  // Labels no small tree fits, with some of them flipped, so that every tree
+  // misclassifies examples and the weights keep changing.
+  vector<Example> examples(2000);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    const Value a = i % 37, b = (i * 11) % 29, c = (i * 7) % 17;
+    examples[i].values = {a, b, c};
+    const bool positive = (a + b > 30) != (c < 5);
+    examples[i].label = (positive != (i % 23 == 0)) ? 1 : -1;
+    examples[i].weight = 1.0 / examples.size();
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  FLAGS_tree_depth = 3;
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_loss_type = "exponential";
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data);
+  for (int iter = 0; iter < 200; ++iter) {
+    trainer.AddTree();
+  }
+  double sum = 0;
+  for (Weight weight : trainer.weights()) sum += weight;
+  EXPECT_NEAR(1, sum, 1e-6);
+}
+
+TEST_F(BoostTest, TestTrainersConcurrently) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_loss_type = "exponential";
+  BoostParams params[2] = {BoostParamsFromFlags(), BoostParamsFromFlags()};
+  params[0].tree_params.tree_depth = 1;
+  params[1].tree_params.tree_depth = 2;
+  params[1].loss_type = "logistic";
+  // Train each model on its own.
+  Model models[2];
+  for (int i = 0; i < 2; ++i) {
+    DeepBoostTrainer trainer(params[i], data_);
+    for (int iter = 0; iter < 5; ++iter) trainer.AddTree();
+    models[i] = trainer.model();
+  }
+  // Train both models at the same time on the same data, which they do not
+  // change.
+  DeepBoostTrainer trainer0(params[0], data_), trainer1(params[1], data_);
+  std::thread threads[2];
+  DeepBoostTrainer* trainers[2] = {&trainer0, &trainer1};
+  for (int i = 0; i < 2; ++i) {
+    threads[i] = std::thread([&trainers, i]() {
+      for (int iter = 0; iter < 5; ++iter) trainers[i]->AddTree();
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  for (int i = 0; i < 2; ++i) {
+    const Model& model = trainers[i]->model();
+    ASSERT_EQ(models[i].size(), model.size());
+    for (size_t j = 0; j < model.size(); ++j) {
+      EXPECT_EQ(models[i][j].first, model[j].first);
+      const Tree& tree = model[j].second;
+      ASSERT_EQ(models[i][j].second.size(), tree.size());
+      for (size_t k = 0; k < tree.size(); ++k) {
+        EXPECT_EQ(models[i][j].second[k].split_feature, tree[k].split_feature);
+        EXPECT_EQ(models[i][j].second[k].split_value, tree[k].split_value);
+        EXPECT_EQ(models[i][j].second[k].label, tree[k].label);
+      }
+    }
+  }
+  for (Weight weight : data_.weights) EXPECT_EQ(0.2f, weight);
 }
 
 TEST_F(BoostTest, TestClassifyExampleDepthOne) {
@@ -83,9 +209,10 @@ TEST_F(BoostTest, TestClassifyExampleDepthOne) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_loss_type = "exponential";
-  Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  trainer.AddTree();
+  trainer.AddTree();
   // By the previous test, the first tree gets example 3 wrong and has weight
   // 0.69314718056, and the second tree has weight gets example 4 wrong and has
   // weight 0.97295507452. Since 0.97295507452 > 0.69314718056, the second tree
@@ -103,8 +230,9 @@ TEST_F(BoostTest, TestClassifyExampleDepthTwo) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_loss_type = "exponential";
-  Model model;
-  AddTreeToModel(examples_, &model);
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  trainer.AddTree();
   // Depth 2 trees can classify all examples perfectly.
   EXPECT_EQ(examples_[0].label, ClassifyExample(examples_[0], model));
   EXPECT_EQ(examples_[1].label, ClassifyExample(examples_[1], model));
@@ -114,7 +242,7 @@ TEST_F(BoostTest, TestClassifyExampleDepthTwo) {
   const float alpha = model[0].first;
   // Won't actually add trees, will just increase weight on current tree.
   for (int i = 0; i < 99; ++i) {
-    AddTreeToModel(examples_, &model);
+    trainer.AddTree();
   }
   EXPECT_EQ(1, model.size());
   EXPECT_NEAR(alpha, model[0].first / 100, kTolerance * 100);
@@ -125,6 +253,93 @@ TEST_F(BoostTest, TestClassifyExampleDepthTwo) {
   EXPECT_EQ(examples_[4].label, ClassifyExample(examples_[4], model));
 }
 
+TEST_F(BoostTest, TestScoreExamplePackedModel) {
+  FLAGS_tree_depth = 2;
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_loss_type = "exponential";
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  for (int i = 0; i < 3; ++i) {
+    trainer.AddTree();
+  }
+  const Model& model = trainer.model();
+  PackedModel packed_model;
+  PackModel(model, &packed_model);
+  ASSERT_EQ(model.size(), packed_model.weights.size());
+  ASSERT_EQ(model.size(), packed_model.roots.size());
+  int num_nodes = 0;
+  for (size_t i = 0; i < model.size(); ++i) {
+    EXPECT_EQ(model[i].first, packed_model.weights[i]);
+    EXPECT_EQ(num_nodes, packed_model.roots[i]);
+    num_nodes += model[i].second.size();
+  }
+  EXPECT_EQ(num_nodes, packed_model.nodes.size());
+  for (const Example& example : examples_) {
+    EXPECT_EQ(ScoreExample(example, model),
+              ScoreExample(example, packed_model));
+  }
+}
+
+TEST_F(BoostTest, TestScoreExamplesHeapModel) {
+  // More examples than fit in one block, and trees of different depths.
+  vector<Example> examples;
+  Model model = TrainModelOfDepthThree(300, &examples);
+  model.push_back(make_pair(0.25, Tree(1, model[0].second.back())));
+  // The last tree is a single leaf, so it is padded.
+  const int depth = ModelDepth(model);
+  ASSERT_GE(depth, 1);
+  HeapModel heap_model;
+  MakeHeapModel(model, &heap_model);
+  EXPECT_EQ(depth, heap_model.depth);
+  EXPECT_EQ(model.size(), heap_model.weights.size());
+  // Missing values go the same way as in the trees.
+  examples[1].values[0] = examples[2].values[1] =
+      std::numeric_limits<Value>::quiet_NaN();
+  vector<float> scores;
+  ScoreExamples(examples, heap_model, &scores);
+  ASSERT_EQ(examples.size(), scores.size());
+  for (size_t j = 0; j < examples.size(); ++j) {
+    EXPECT_EQ(ScoreExample(examples[j], model), scores[j]);
+  }
+}
+
+TEST_F(BoostTest, TestScoreBatch) {
+  // More rows than one thread takes at a time, so that several threads score.
+  vector<Example> examples;
+  Model model = TrainModelOfDepthThree(5000, &examples);
+  FeatureMatrix matrix;
+  MakeFeatureMatrix(examples, &matrix);
+  EXPECT_EQ(examples.size(), matrix.num_rows);
+  EXPECT_EQ(2, matrix.num_features);
+  vector<float> scores(examples.size());
+  ScoreBatch(matrix, model, scores.data());
+  for (size_t j = 0; j < examples.size(); ++j) {
+    EXPECT_EQ(ScoreExample(examples[j], model), scores[j]);
+  }
+  for (int num_threads : {1, 3}) {
+    ScoreBatch(matrix, model, num_threads, scores.data());
+    for (size_t j = 0; j < examples.size(); ++j) {
+      EXPECT_EQ(ScoreExample(examples[j], model), scores[j]);
+    }
+  }
+  // A chain of splits too deep for the heap layout.
+  Tree deep_tree;
+  for (int k = 0; k <= kMaxHeapTreeDepth; ++k) {
+    Node split = {0, static_cast<Value>(k), 2 * k + 1, 2 * k + 2, 0, false};
+    Node leaf = {0, 0, 0, 0, k % 2 == 0 ? 1 : -1, true};
+    deep_tree.push_back(split);
+    deep_tree.push_back(leaf);
+  }
+  deep_tree.push_back(deep_tree[1]);
+  deep_tree.back().label = 1;
+  model.push_back(make_pair(0.5, deep_tree));
+  ASSERT_GT(ModelDepth(model), kMaxHeapTreeDepth);
+  ScoreBatch(matrix, model, scores.data());
+  for (size_t j = 0; j < examples.size(); ++j) {
+    EXPECT_EQ(ScoreExample(examples[j], model), scores[j]);
+  }
+}
+
 TEST_F(BoostTest, TestClassifyExampleEmptyModel) {
   Model model;
   // Empty model classifies every example as positive
@@ -140,9 +355,10 @@ TEST_F(BoostTest, TestEvaluateModelDepthOne) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_loss_type = "exponential";
-  Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  trainer.AddTree();
+  trainer.AddTree();
   float error, avg_tree_size;
   int num_trees;
   EvaluateModel(examples_, model, &error, &avg_tree_size, &num_trees);
@@ -156,8 +372,9 @@ TEST_F(BoostTest, TestEvaluateModelDepthTwo) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_loss_type = "exponential";
-  Model model;
-  AddTreeToModel(examples_, &model);
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  trainer.AddTree();
   float error, avg_tree_size;
   int num_trees;
   EvaluateModel(examples_, model, &error, &avg_tree_size, &num_trees);
@@ -166,22 +383,142 @@ TEST_F(BoostTest, TestEvaluateModelDepthTwo) {
   EXPECT_NEAR(5, avg_tree_size, kTolerance);
 }
 
+TEST_F(BoostTest, TestEvaluateModelMarginCache) {
+  FLAGS_tree_depth = 1;
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_loss_type = "exponential";
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  MarginCache margin_cache;
+  for (int iter = 0; iter < 6; ++iter) {
+    trainer.AddTree();
+    float error, avg_tree_size, cached_error, cached_avg_tree_size;
+    int num_trees, cached_num_trees;
+    EvaluateModel(examples_, model, &error, &avg_tree_size, &num_trees);
+    EvaluateModel(examples_, model, &margin_cache, &cached_error,
+                  &cached_avg_tree_size, &cached_num_trees);
+    EXPECT_EQ(error, cached_error);
+    EXPECT_EQ(avg_tree_size, cached_avg_tree_size);
+    EXPECT_EQ(num_trees, cached_num_trees);
+    ASSERT_EQ(model.size(), margin_cache.tree_weights.size());
+    for (size_t i = 0; i < examples_.size(); ++i) {
+      float score = 0;
+      for (const pair<Weight, Tree>& wgtd_tree : model) {
+        score += wgtd_tree.first * ClassifyExample(examples_[i],
+                                                   wgtd_tree.second);
+      }
+      EXPECT_NEAR(score, margin_cache.margins[i], kTolerance);
+    }
+  }
+}
+
+TEST_F(BoostTest, TestEvaluateModelHistory) {
+  FLAGS_tree_depth = 1;
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_loss_type = "exponential";
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  ModelHistory history;
+  vector<float> errors, avg_tree_sizes;
+  vector<int> num_trees;
+  for (int iter = 0; iter < 6; ++iter) {
+    vector<Weight> old_tree_weights;
+    for (const pair<Weight, Tree>& wgtd_tree : model) {
+      old_tree_weights.push_back(wgtd_tree.first);
+    }
+    trainer.AddTree();
+    RecordModelUpdate(old_tree_weights, model, &history);
+    ASSERT_EQ(iter + 1, history.size());
+    const ModelUpdate& update = history.back();
+    ASSERT_LE(0, update.tree_index);
+    EXPECT_EQ(model[update.tree_index].first, update.weight);
+    float error, avg_tree_size;
+    int model_num_trees;
+    EvaluateModel(examples_, model, &error, &avg_tree_size, &model_num_trees);
+    errors.push_back(error);
+    avg_tree_sizes.push_back(avg_tree_size);
+    num_trees.push_back(model_num_trees);
+  }
+  // The first update adds the first tree.
+  EXPECT_EQ(0, history[0].tree_index);
+  EXPECT_EQ(3, model[0].second.size());
+  vector<float> history_errors, history_avg_tree_sizes;
+  vector<int> history_num_trees;
+  EvaluateModelHistory(examples_, model, history, &history_errors);
+  CountTreesHistory(model, history, &history_avg_tree_sizes,
+                    &history_num_trees);
+  EXPECT_EQ(errors, history_errors);
+  EXPECT_EQ(avg_tree_sizes, history_avg_tree_sizes);
+  EXPECT_EQ(num_trees, history_num_trees);
+}
+
+TEST_F(BoostTest, TestRestoreModel) {
+  FLAGS_tree_depth = 1;
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_loss_type = "exponential";
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  trainer.AddTree();
+  trainer.AddTree();
+  const Model saved_model = trainer.model();
+  vector<Weight> tree_weights;
+  for (const pair<Weight, Tree>& wgtd_tree : saved_model) {
+    tree_weights.push_back(wgtd_tree.first);
+  }
+  for (int iter = 0; iter < 4; ++iter) {
+    trainer.AddTree();
+  }
+  Model model = trainer.model();
+  RestoreModel(tree_weights, &model);
+  ASSERT_EQ(saved_model.size(), model.size());
+  for (size_t i = 0; i < model.size(); ++i) {
+    EXPECT_EQ(saved_model[i].first, model[i].first);
+    EXPECT_EQ(saved_model[i].second.size(), model[i].second.size());
+  }
+  float error, saved_error, avg_tree_size;
+  int num_trees;
+  EvaluateModel(examples_, model, &error, &avg_tree_size, &num_trees);
+  EvaluateModel(examples_, saved_model, &saved_error, &avg_tree_size,
+                &num_trees);
+  EXPECT_EQ(saved_error, error);
+}
+
+TEST_F(BoostTest, TestSetRegularization) {
+  FLAGS_tree_depth = 1;
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_loss_type = "exponential";
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  trainer.AddTree();
+  ASSERT_EQ(1, model.size());
+  EXPECT_GT(model[0].first, kTolerance);
+  // With a large beta penalty, no new tree is worth adding, and the weight of
+  // the tree already in the model is set back to zero.
+  trainer.SetRegularization(100, 0);
+  trainer.AddTree();
+  ASSERT_EQ(1, model.size());
+  EXPECT_NEAR(0, model[0].first, kTolerance);
+}
+
 TEST_F(BoostTest, ComputeEtaTest) {
   FLAGS_beta = 1;
   FLAGS_lambda = 1;
-  float eta = ComputeEta(1, 10, 1);
+  float eta = ComputeEta(Context(), 1, 10, 1);
   EXPECT_NEAR(-1, eta, kTolerance);
 
   FLAGS_beta = 1;
   FLAGS_lambda = 0;
-  eta = ComputeEta(0.1, 5, 2);
-  float ratio = ComplexityPenalty(5) / 0.1;
+  eta = ComputeEta(Context(), 0.1, 5, 2);
+  float ratio = ComplexityPenalty(Context(), 5) / 0.1;
   EXPECT_NEAR(log(-ratio + sqrt(ratio * ratio + (0.9 / 0.1))), eta, kTolerance);
 
   FLAGS_beta = 0;
   FLAGS_lambda = 1;
-  eta = ComputeEta(0.75, 10, -10);
-  ratio = ComplexityPenalty(10) / 0.75;
+  eta = ComputeEta(Context(), 0.75, 10, -10);
+  ratio = ComplexityPenalty(Context(), 10) / 0.75;
   EXPECT_NEAR(log(ratio + sqrt(ratio * ratio + (0.25 / 0.75))),
               eta, kTolerance);
 }
@@ -192,9 +529,10 @@ TEST_F(BoostTest, TestAddTreeToModelLargeBeta) {
   FLAGS_beta = 100;
   FLAGS_lambda = 0;
   FLAGS_loss_type = "exponential";
-  Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  trainer.AddTree();
+  trainer.AddTree();
   EXPECT_EQ(2, model.size());
   EXPECT_LT(model[0].first, kTolerance);
   EXPECT_LT(model[1].first, kTolerance);
@@ -208,9 +546,10 @@ TEST_F(BoostTest, TestAddTreeToModelLargeLambda) {
   FLAGS_beta = 0;
   FLAGS_lambda = 100;
   FLAGS_loss_type = "exponential";
-  Model model;
-  AddTreeToModel(examples_, &model);
-  AddTreeToModel(examples_, &model);
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
+  const Model& model = trainer.model();
+  trainer.AddTree();
+  trainer.AddTree();
   EXPECT_EQ(2, model.size());
   EXPECT_LT(model[0].first, kTolerance);
   EXPECT_LT(model[1].first, kTolerance);
@@ -223,10 +562,10 @@ TEST_F(BoostTest, TestAddTreeToModelLogisticLoss) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_loss_type = "logistic";
-  Model model;
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data_);
   // Train a model with a single tree. The tree's weighted error will be 0.2,
   // and it will only get example 3 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTree();
   // alpha1 = 0.5 * log((1 - error) / error), where error = 0.2.
   float alpha1 = 0.69314718056;
   // Normalizer is sum of all adjusted weights.
@@ -235,15 +574,15 @@ TEST_F(BoostTest, TestAddTreeToModelLogisticLoss) {
   // Adjust weights and normalize.
   float correct_wgt = (1 / (1 + exp(alpha1 - 1))) / normalizer;
   float incorrect_wgt = (1 / (1 + exp(-alpha1 - 1))) / normalizer;
-  EXPECT_NEAR(correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(incorrect_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(incorrect_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(correct_wgt, trainer.weights()[4], kTolerance);
 
   // Add another tree to the model. The tree's weighted error will be
   // 0.182946235, and it will only get example 4 wrong.
-  AddTreeToModel(examples_, &model);
+  trainer.AddTree();
   // alpha2 = 0.5 * log((1 - error) / error), where error = 0.182946235.
   float alpha2 = 0.7482563445;
   // Normalizer is sum of all adjusted weights.
@@ -253,9 +592,9 @@ TEST_F(BoostTest, TestAddTreeToModelLogisticLoss) {
   float both_correct_wgt = (1 / (1 + exp(alpha1 + alpha2 - 1))) / normalizer;
   float first_correct_wgt = (1 / (1 + exp(alpha1 - alpha2 - 1))) / normalizer;
   float second_correct_wgt = (1 / (1 + exp(-alpha1 + alpha2 - 1))) / normalizer;
-  EXPECT_NEAR(both_correct_wgt, examples_[0].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[1].weight, kTolerance);
-  EXPECT_NEAR(both_correct_wgt, examples_[2].weight, kTolerance);
-  EXPECT_NEAR(second_correct_wgt, examples_[3].weight, kTolerance);
-  EXPECT_NEAR(first_correct_wgt, examples_[4].weight, kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[0], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[1], kTolerance);
+  EXPECT_NEAR(both_correct_wgt, trainer.weights()[2], kTolerance);
+  EXPECT_NEAR(second_correct_wgt, trainer.weights()[3], kTolerance);
+  EXPECT_NEAR(first_correct_wgt, trainer.weights()[4], kTolerance);
 }
@@ -14,10 +14,18 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "boost.h"
 #include "io.h"
+#include "model_io.h"
+#include "parallel.h"
 #include "types.h"
 
 DECLARE_int32(tree_depth);
@@ -29,10 +37,230 @@ DECLARE_int32(fold_to_test);
 DECLARE_double(beta);
 DECLARE_double(lambda);
 DECLARE_string(loss_type);
+DECLARE_string(split_mode);
+DECLARE_int32(max_bins);
+DECLARE_int32(num_threads);
+DECLARE_string(growth);
+DECLARE_int32(max_leaves);
 DEFINE_int32(num_iter, 200,
              "Number of boosting iterations. Required: num_iter >= 1.");
 DEFINE_int32(seed, 42,
              "Seed for random number generator. Required: seed >= 0.");
+DEFINE_int32(eval_every, 1,
+             "Evaluate the model every eval_every iterations, and after the "
+             "last iteration. Required: eval_every >= 1.");
+DEFINE_string(eval_sets, "test,cv",
+              "Comma-separated list of the sets to evaluate the model on. "
+              "Required: Each one of test, cv, train, and at least one.");
+DEFINE_bool(eval_deferred, false,
+            "Evaluate the model only after training, by replaying the "
+            "history of its changes. Prints the same results as evaluating "
+            "during training.");
+DEFINE_int32(early_stopping_rounds, 0,
+             "Stop training once the cv error has not improved for "
+             "early_stopping_rounds iterations, and keep the model as it was "
+             "at the iteration with the lowest cv error. The cv error is only "
+             "checked at the iterations evaluated. 0 disables early stopping. "
+             "Required: early_stopping_rounds >= 0, and 0 if eval_deferred.");
+DEFINE_bool(cv_all_folds, false,
+            "Read the data once and train one model per fold, up to "
+            "num_threads of them at the same time, where the model of fold k is tested on fold k and "
+            "cross-validated on fold k - 1 (mod num_folds), instead of "
+            "training one model with fold_to_cv and fold_to_test. Prints the "
+            "errors of each model after training, and their mean and "
+            "standard deviation. Required: eval_deferred is false.");
+DEFINE_string(mode, "train",
+              "What to do. train trains a model on the data set and prints its "
+              "errors. predict scores every example of data_filename with the "
+              "model in model_in. Required: One of train, predict.");
+DEFINE_string(model_out, "",
+              "File to save the trained model to, in the binary model format. "
+              "With early stopping, the model of the best iteration is saved. "
+              "Empty means the model is not saved. Required: empty if "
+              "cv_all_folds or mode is predict.");
+DEFINE_string(model_in, "",
+              "File to load the model to predict with from, saved by "
+              "model_out. Required: Not empty if and only if mode is "
+              "predict.");
+DEFINE_string(scores_filename, "",
+              "File to write the scores of predict to, one per example, in "
+              "the order of the examples in data_filename. Lines of "
+              "data_filename that hold no example get no score. Empty means "
+              "standard output.");
+
+// The sets the model can be evaluated on, in the order they are printed.
+enum EvalSet { kTest, kCv, kTrain, kNumEvalSets };
+static const char* const kEvalSetNames[kNumEvalSets] = {"test", "cv",
+                                                        "train"};
+
+// Set evaluated[set] to whether set is listed in eval_sets.
+void ParseEvalSets(bool evaluated[kNumEvalSets]) {
+  vector<string> names;
+  SplitString(FLAGS_eval_sets, ',', &names);
+  std::fill(evaluated, evaluated + kNumEvalSets, false);
+  for (const string& name : names) {
+    const char* const* set =
+        std::find(kEvalSetNames, kEvalSetNames + kNumEvalSets, name);
+    CHECK(set != kEvalSetNames + kNumEvalSets)
+        << "Unexpected evaluation set: " << name;
+    evaluated[set - kEvalSetNames] = true;
+  }
+  CHECK(std::count(evaluated, evaluated + kNumEvalSets, true) > 0);
+}
+
+// Print the errors of the model after iteration iter on the evaluated sets,
+// with iter labeled by label.
+void PrintEvaluation(const char* label, int iter,
+                     const bool evaluated[kNumEvalSets],
+                     const float errors[kNumEvalSets], float avg_tree_size,
+                     int num_trees) {
+  printf("%s: %d, ", label, iter);
+  for (int set = 0; set < kNumEvalSets; ++set) {
+    if (evaluated[set]) printf("%s error: %g, ", kEvalSetNames[set],
+                               errors[set]);
+  }
+  printf("avg tree size: %g, num trees: %d\n", avg_tree_size, num_trees);
+}
+
+// Return whether the model is evaluated after iteration iter.
+bool IsEvalIter(int iter) {
+  return iter % FLAGS_eval_every == 0 || iter == FLAGS_num_iter;
+}
+
+// The iteration with the lowest cv error so far, and the weights of the trees
+// of the model after it.
+typedef struct EarlyStopping {
+  int best_iter = 0;
+  float best_cv_error = 0;
+  vector<Weight> best_tree_weights;
+} EarlyStopping;
+
+// Record that model has cv error cv_error after iteration iter, and return
+// whether training should stop because the cv error has not improved for
+// early_stopping_rounds iterations.
+bool UpdateEarlyStopping(int iter, float cv_error, const Model& model,
+                         EarlyStopping* early_stopping) {
+  if (early_stopping->best_iter == 0 ||
+      cv_error < early_stopping->best_cv_error) {
+    early_stopping->best_iter = iter;
+    early_stopping->best_cv_error = cv_error;
+    GetTreeWeights(model, &early_stopping->best_tree_weights);
+    return false;
+  }
+  return iter - early_stopping->best_iter >= FLAGS_early_stopping_rounds;
+}
+
+// The model of one fold with cv_all_folds, after training.
+typedef struct FoldResult {
+  int num_iter;  // The iteration the model is from.
+  float errors[kNumEvalSets];
+  float avg_tree_size;
+  int num_trees;
+} FoldResult;
+
+// Train the model of fold on examples read by ReadExamples(), and evaluate it
+// on all sets.
+void TrainFold(const vector<Example>& examples, int fold, FoldResult* result) {
+  vector<Example> train_examples, cv_examples, test_examples;
+  SplitExamples(examples, (fold + FLAGS_num_folds - 1) % FLAGS_num_folds, fold,
+                &train_examples, &cv_examples, &test_examples);
+  const BoostParams params = BoostParamsFromFlags();
+  ColumnarDataset train_data;
+  ColumnIndex train_index;
+  MakeColumnarDataset(train_examples, &train_data);
+  MakeColumnIndex(params.tree_params, train_data, &train_index);
+  DropBinnedValues(train_index, &train_data);
+  DeepBoostTrainer trainer(params, train_data, train_index);
+  MarginCache cv_margins;
+  EarlyStopping early_stopping;
+  result->num_iter = FLAGS_num_iter;
+  for (int iter = 1; iter <= FLAGS_num_iter; ++iter) {
+    trainer.AddTree();
+    if (FLAGS_early_stopping_rounds == 0 || !IsEvalIter(iter)) continue;
+    float cv_error, avg_tree_size;
+    int num_trees;
+    EvaluateModel(cv_examples, trainer.model(), &cv_margins, &cv_error,
+                  &avg_tree_size, &num_trees);
+    if (UpdateEarlyStopping(iter, cv_error, trainer.model(),
+                            &early_stopping)) {
+      break;
+    }
+  }
+  Model model = trainer.model();
+  if (FLAGS_early_stopping_rounds > 0) {
+    RestoreModel(early_stopping.best_tree_weights, &model);
+    result->num_iter = early_stopping.best_iter;
+  }
+  const vector<Example>* eval_examples[kNumEvalSets] = {
+      &test_examples, &cv_examples, &train_examples};
+  for (int set = 0; set < kNumEvalSets; ++set) {
+    EvaluateModel(*eval_examples[set], model, &result->errors[set],
+                  &result->avg_tree_size, &result->num_trees);
+  }
+}
+
+// Train the models of all folds, num_threads at a time, and print their errors
+// on the evaluated sets.
+void CrossValidateAllFolds(const bool evaluated[kNumEvalSets]) {
+  vector<Example> examples;
+  ReadExamples(&examples);
+  vector<FoldResult> results(FLAGS_num_folds);
+  ParallelFor(0, FLAGS_num_folds, FLAGS_num_threads, [&](int fold) {
+    TrainFold(examples, fold, &results[fold]);
+  });
+  for (int fold = 0; fold < FLAGS_num_folds; ++fold) {
+    const FoldResult& result = results[fold];
+    printf("Fold: %d, iteration: %d, ", fold, result.num_iter);
+    for (int set = 0; set < kNumEvalSets; ++set) {
+      if (evaluated[set]) printf("%s error: %g, ", kEvalSetNames[set],
+                                 result.errors[set]);
+    }
+    printf("avg tree size: %g, num trees: %d\n", result.avg_tree_size,
+           result.num_trees);
+  }
+  const char* separator = "";
+  for (int set = 0; set < kNumEvalSets; ++set) {
+    if (!evaluated[set]) continue;
+    double sum = 0, sum_squares = 0;
+    for (const FoldResult& result : results) {
+      sum += result.errors[set];
+      sum_squares += result.errors[set] * result.errors[set];
+    }
+    const double mean = sum / FLAGS_num_folds;
+    // The sample standard deviation over the folds.
+    const double variance =
+        (sum_squares - FLAGS_num_folds * mean * mean) / (FLAGS_num_folds - 1);
+    printf("%s%s error mean: %g, std: %g", separator, kEvalSetNames[set], mean,
+           sqrt(fmax(variance, 0)));
+    separator = ", ";
+  }
+  printf("\n");
+}
+
+// Score every example of data_filename with the model in model_in, reading
+// one line at a time, and write the scores to scores_filename. The model is
+// mapped rather than loaded, so it is scored straight from the page cache.
+void Predict() {
+  MappedModel model(FLAGS_model_in);
+  model.Validate();
+  std::ifstream file(FLAGS_data_filename);
+  CHECK(file.is_open()) << "Could not open " << FLAGS_data_filename;
+  FILE* scores_file = stdout;
+  if (!FLAGS_scores_filename.empty()) {
+    scores_file = fopen(FLAGS_scores_filename.c_str(), "w");
+    CHECK(scores_file != nullptr) << "Could not open "
+                                  << FLAGS_scores_filename;
+  }
+  string line;
+  while (std::getline(file, line)) {
+    Example example;
+    if (!ParseLine(line, &example)) continue;
+    CHECK(model.HasFeatures(example))
+        << "The model splits on features the examples do not have";
+    fprintf(scores_file, "%g\n", model.ScoreExample(example));
+  }
+  if (scores_file != stdout) fclose(scores_file);
+}
 
 void ValidateFlags() {
   CHECK_GE(FLAGS_tree_depth, 0);
@@ -53,6 +281,23 @@ void ValidateFlags() {
   CHECK_GE(FLAGS_beta, 0.0);
   CHECK_GE(FLAGS_lambda, 0.0);
   CHECK(FLAGS_loss_type == "exponential" || FLAGS_loss_type == "logistic");
+  CHECK(FLAGS_split_mode == "exact" || FLAGS_split_mode == "histogram");
+  CHECK_GE(FLAGS_max_bins, 2);
+  CHECK_LE(FLAGS_max_bins, 255);
+  CHECK_GE(FLAGS_num_threads, 1);
+  CHECK(FLAGS_growth == "breadth_first" || FLAGS_growth == "level_wise" ||
+        FLAGS_growth == "best_first");
+  CHECK_GE(FLAGS_max_leaves, 1);
+  CHECK_GE(FLAGS_eval_every, 1);
+  CHECK_GE(FLAGS_early_stopping_rounds, 0);
+  CHECK(FLAGS_early_stopping_rounds == 0 || !FLAGS_eval_deferred);
+  CHECK(!FLAGS_cv_all_folds || !FLAGS_eval_deferred);
+  CHECK(FLAGS_mode == "train" || FLAGS_mode == "predict");
+  CHECK(FLAGS_model_out.empty() ||
+        (!FLAGS_cv_all_folds && FLAGS_mode != "predict"));
+  CHECK_EQ(FLAGS_model_in.empty(), FLAGS_mode != "predict");
+  bool evaluated[kNumEvalSets];
+  ParseEvalSets(evaluated);
 }
 
 int main(int argc, char** argv) {
@@ -63,23 +308,105 @@ int main(int argc, char** argv) {
 
   SetSeed(FLAGS_seed);
 
+  if (FLAGS_mode == "predict") {
+    Predict();
+    return 0;
+  }
+
+  if (FLAGS_cv_all_folds) {
+    bool evaluated[kNumEvalSets];
+    ParseEvalSets(evaluated);
+    CrossValidateAllFolds(evaluated);
+    return 0;
+  }
+
   vector<Example> train_examples, cv_examples, test_examples;
-  ReadData(&train_examples, &cv_examples, &test_examples);
+  ColumnarDataset train_data;
+  ColumnIndex train_index;
+  ReadData(&train_examples, &cv_examples, &test_examples, &train_data,
+           &train_index);
 
-  Model model;
+  bool evaluated[kNumEvalSets];
+  ParseEvalSets(evaluated);
+  const vector<Example>* eval_examples[kNumEvalSets] = {
+      &test_examples, &cv_examples, &train_examples};
+
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), train_data, train_index);
+  const Model& model = trainer.model();
+  // Each iteration adds or reweights one tree, so the scores of the
+  // evaluated examples are updated with that tree only.
+  MarginCache margins[kNumEvalSets];
+  ModelHistory history;
+  vector<Weight> old_tree_weights;
+  EarlyStopping early_stopping;
   for (int iter = 1; iter <= FLAGS_num_iter; ++iter) {
-    AddTreeToModel(train_examples, &model);
-    // TODO(usyed): Evaluating every iteration might be very expensive. Add an
-    // option to evaluate every K iterations, where K is a command-line
-    // parameter.
-    float cv_error, test_error, avg_tree_size;
+    if (FLAGS_eval_deferred) GetTreeWeights(model, &old_tree_weights);
+    trainer.AddTree();
+    if (FLAGS_eval_deferred) {
+      RecordModelUpdate(old_tree_weights, model, &history);
+      continue;
+    }
+    if (!IsEvalIter(iter)) continue;
+    float errors[kNumEvalSets], avg_tree_size;
     int num_trees;
-    EvaluateModel(cv_examples, model, &cv_error, &avg_tree_size,
-                  &num_trees);
-    EvaluateModel(test_examples, model, &test_error, &avg_tree_size,
-                  &num_trees);
-    printf("Iteration: %d, test error: %g, cv error: %g, "
-           "avg tree size: %g, num trees: %d\n",
-           iter, test_error, cv_error, avg_tree_size, num_trees);
+    for (int set = 0; set < kNumEvalSets; ++set) {
+      if (!evaluated[set]) continue;
+      EvaluateModel(*eval_examples[set], model, &margins[set], &errors[set],
+                    &avg_tree_size, &num_trees);
+    }
+    PrintEvaluation("Iteration", iter, evaluated, errors, avg_tree_size,
+                    num_trees);
+    if (FLAGS_early_stopping_rounds > 0) {
+      if (!evaluated[kCv]) {
+        EvaluateModel(cv_examples, model, &margins[kCv], &errors[kCv],
+                      &avg_tree_size, &num_trees);
+      }
+      if (UpdateEarlyStopping(iter, errors[kCv], model, &early_stopping)) {
+        break;
+      }
+    }
+  }
+
+  if (FLAGS_early_stopping_rounds > 0) {
+    Model best_model = model;
+    RestoreModel(early_stopping.best_tree_weights, &best_model);
+    float errors[kNumEvalSets], avg_tree_size;
+    int num_trees;
+    for (int set = 0; set < kNumEvalSets; ++set) {
+      if (!evaluated[set]) continue;
+      EvaluateModel(*eval_examples[set], best_model, &errors[set],
+                    &avg_tree_size, &num_trees);
+    }
+    PrintEvaluation("Best iteration", early_stopping.best_iter, evaluated,
+                    errors, avg_tree_size, num_trees);
+  }
+
+  if (!FLAGS_model_out.empty()) {
+    Model saved_model = model;
+    if (FLAGS_early_stopping_rounds > 0) {
+      RestoreModel(early_stopping.best_tree_weights, &saved_model);
+    }
+    SaveModel(saved_model, FLAGS_model_out);
+  }
+
+  if (FLAGS_eval_deferred) {
+    vector<float> set_errors[kNumEvalSets];
+    for (int set = 0; set < kNumEvalSets; ++set) {
+      if (!evaluated[set]) continue;
+      EvaluateModelHistory(*eval_examples[set], model, history,
+                           &set_errors[set]);
+    }
+    vector<float> avg_tree_sizes;
+    vector<int> num_trees;
+    CountTreesHistory(model, history, &avg_tree_sizes, &num_trees);
+    for (int iter = 1; iter <= FLAGS_num_iter; ++iter) {
+      if (!IsEvalIter(iter)) continue;
+      float errors[kNumEvalSets];
+      for (int set = 0; set < kNumEvalSets; ++set) {
+        if (evaluated[set]) errors[set] = set_errors[set][iter - 1];
+      }
+      PrintEvaluation("Iteration", iter, evaluated, errors,
+                      avg_tree_sizes[iter - 1], num_trees[iter - 1]);
+    }
   }
 }
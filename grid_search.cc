@@ -0,0 +1,409 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Trains one model per combination of the listed values of beta, lambda,
+// tree_depth and loss_type, and writes a table of their errors, best cv error
+// first. The data set is read, split and indexed once, and shared by all
+// models. The other hyperparameters are given by the usual flags. With
+// halving_min_iter, the models are pruned by successive halving instead of all
+// being trained for num_iter iterations. With path_param, the models along
+// each regularization path are trained one after the other, each warm-started
+// from the previous one. With model_out_prefix, the model of every cell is
+// written to a file of its own.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <thread>
+#include <tuple>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "boost.h"
+#include "io.h"
+#include "model_io.h"
+#include "parallel.h"
+#include "types.h"
+
+DECLARE_double(beta);
+DECLARE_double(lambda);
+DECLARE_int32(tree_depth);
+DECLARE_string(loss_type);
+DECLARE_string(data_filename);
+DECLARE_int32(num_folds);
+DECLARE_int32(fold_to_cv);
+DECLARE_int32(fold_to_test);
+DECLARE_string(split_mode);
+DECLARE_int32(max_bins);
+DECLARE_string(growth);
+DECLARE_int32(max_leaves);
+DEFINE_string(betas, "",
+              "Comma-separated list of the values of beta to try. Empty means "
+              "only the value of beta.");
+DEFINE_string(lambdas, "",
+              "Comma-separated list of the values of lambda to try. Empty "
+              "means only the value of lambda.");
+DEFINE_string(tree_depths, "",
+              "Comma-separated list of the values of tree_depth to try. Empty "
+              "means only the value of tree_depth.");
+DEFINE_string(loss_types, "",
+              "Comma-separated list of the values of loss_type to try. Empty "
+              "means only the value of loss_type.");
+DEFINE_int32(num_iter, 200,
+             "Number of boosting iterations of each model. Required: "
+             "num_iter >= 1.");
+DEFINE_int32(seed, 42,
+             "Seed for random number generator. Required: seed >= 0.");
+DEFINE_int32(grid_threads, 0,
+             "Number of models to train at the same time. 0 means one per "
+             "core. Required: grid_threads >= 0.");
+DEFINE_int32(halving_min_iter, 0,
+             "Train every model for halving_min_iter iterations, keep training "
+             "the best 1 / halving_factor of them by cv error for "
+             "halving_factor times as many iterations, and so on, until "
+             "num_iter iterations are reached. The models kept continue from "
+             "where they were. 0 trains every model for num_iter iterations. "
+             "Required: halving_min_iter >= 0.");
+DEFINE_int32(halving_factor, 3,
+             "See halving_min_iter. Required: halving_factor >= 2.");
+DEFINE_string(path_param, "",
+              "Train the models along regularization paths over path_param, "
+              "one of lambda, beta: models that differ only in path_param are "
+              "trained one after the other, from the largest listed value of "
+              "path_param to the smallest, each starting from the model and "
+              "example weights of the one before. Empty trains every model "
+              "from scratch. Required: halving_min_iter is 0 if path_param is "
+              "set.");
+DEFINE_int32(path_iter, 0,
+             "Number of iterations each model along a path but the first is "
+             "trained for, on top of those of the model it starts from. 0 "
+             "means num_iter / 10, or 1 if that is 0. Required: path_iter >= "
+             "0.");
+DEFINE_string(model_out_prefix, "",
+              "If set, write the model of every cell that was not pruned to "
+              "the file named model_out_prefix followed by the cell's "
+              "hyperparameters, in the binary model format.");
+DEFINE_string(results_filename, "",
+              "File to write the results table to. Empty means standard "
+              "output.");
+
+// The data set, read and split once and shared by all models.
+typedef struct GridData {
+  vector<Example> train_examples;
+  vector<Example> cv_examples;
+  vector<Example> test_examples;
+  ColumnarDataset train_data;
+  ColumnIndex train_index;
+} GridData;
+
+// One combination of hyperparameters, its model, and the errors of the model
+// after the iterations trained so far.
+typedef struct GridCell {
+  BoostParams params;
+  // Made when the model is first trained, and released once it is pruned. The
+  // models along a path share one trainer.
+  std::shared_ptr<DeepBoostTrainer> trainer;
+  // The weights of the trees of the trainer's model once the cell was trained.
+  // A trainer only ever adds trees, so the cell's model is the trainer's model
+  // restored to these weights by RestoreModel(), even after later cells of its
+  // path have trained it further.
+  vector<Weight> tree_weights;
+  MarginCache cv_margins;
+  MarginCache test_margins;
+  int num_iter = 0;
+  // The last round of successive halving the model was trained in.
+  int round = 0;
+  float cv_error;
+  float test_error;
+  float avg_tree_size;
+  int num_trees;
+} GridCell;
+
+// Set values to the numbers listed in text, or to just default_value if text
+// is empty.
+void ParseDoubleList(const string& text, double default_value,
+                     vector<double>* values) {
+  values->clear();
+  vector<string> tokens;
+  SplitString(text, ',', &tokens);
+  for (const string& token : tokens) {
+    char* end;
+    values->push_back(strtod(token.c_str(), &end));
+    CHECK(*end == '\0') << "Unexpected number: " << token;
+  }
+  if (values->empty()) values->push_back(default_value);
+}
+
+// Same as above, for integers.
+void ParseIntList(const string& text, int default_value, vector<int>* values) {
+  values->clear();
+  vector<string> tokens;
+  SplitString(text, ',', &tokens);
+  for (const string& token : tokens) {
+    char* end;
+    values->push_back(strtol(token.c_str(), &end, 10));
+    CHECK(*end == '\0') << "Unexpected integer: " << token;
+  }
+  if (values->empty()) values->push_back(default_value);
+}
+
+// Same as above, for strings.
+void ParseStringList(const string& text, const string& default_value,
+                     vector<string>* values) {
+  SplitString(text, ',', values);
+  if (values->empty()) values->push_back(default_value);
+}
+
+// Set cells to every combination of the listed hyperparameters, with the rest
+// given by the flags. Cells with deeper trees come first, since they take
+// longest to train.
+void MakeGridCells(vector<GridCell>* cells) {
+  vector<double> betas, lambdas;
+  vector<int> tree_depths;
+  vector<string> loss_types;
+  ParseDoubleList(FLAGS_betas, FLAGS_beta, &betas);
+  ParseDoubleList(FLAGS_lambdas, FLAGS_lambda, &lambdas);
+  ParseIntList(FLAGS_tree_depths, FLAGS_tree_depth, &tree_depths);
+  ParseStringList(FLAGS_loss_types, FLAGS_loss_type, &loss_types);
+  std::sort(tree_depths.rbegin(), tree_depths.rend());
+  cells->clear();
+  for (int tree_depth : tree_depths) {
+    CHECK_GE(tree_depth, 0);
+    for (double beta : betas) {
+      CHECK_GE(beta, 0.0);
+      for (double lambda : lambdas) {
+        CHECK_GE(lambda, 0.0);
+        for (const string& loss_type : loss_types) {
+          CHECK(loss_type == "exponential" || loss_type == "logistic")
+              << "Unexpected loss type: " << loss_type;
+          GridCell cell;
+          cell.params = BoostParamsFromFlags();
+          cell.params.tree_params.beta = beta;
+          cell.params.tree_params.lambda = lambda;
+          cell.params.tree_params.tree_depth = tree_depth;
+          cell.params.loss_type = loss_type;
+          cells->push_back(cell);
+        }
+      }
+    }
+  }
+}
+
+// Train the model of cell until it has had num_iter iterations, and set the
+// errors of cell.
+void TrainGridCell(const GridData& data, int num_iter, GridCell* cell) {
+  if (cell->trainer == nullptr) {
+    cell->trainer = std::make_shared<DeepBoostTrainer>(
+        cell->params, data.train_data, data.train_index);
+  }
+  for (; cell->num_iter < num_iter; ++cell->num_iter) cell->trainer->AddTree();
+  GetTreeWeights(cell->trainer->model(), &cell->tree_weights);
+  EvaluateModel(data.cv_examples, cell->trainer->model(), &cell->cv_margins,
+                &cell->cv_error, &cell->avg_tree_size, &cell->num_trees);
+  EvaluateModel(data.test_examples, cell->trainer->model(),
+                &cell->test_margins, &cell->test_error, &cell->avg_tree_size,
+                &cell->num_trees);
+}
+
+// Return whether a is better than b: kept for a later round of successive
+// halving, or for the same one with a lower cv error.
+bool IsBetterCell(const GridCell* a, const GridCell* b) {
+  if (a->round != b->round) return a->round > b->round;
+  return a->cv_error < b->cv_error;
+}
+
+// Train every cell for num_iter iterations, pruning them by successive halving
+// if halving_min_iter is set. Each round trains the remaining cells for more
+// iterations, then keeps the best 1 / halving_factor of them.
+void TrainGridCells(const GridData& data, int num_threads,
+                    vector<GridCell>* cells) {
+  vector<GridCell*> remaining;
+  for (GridCell& cell : *cells) remaining.push_back(&cell);
+  int round_iter = FLAGS_num_iter;
+  if (FLAGS_halving_min_iter > 0) {
+    round_iter = std::min(FLAGS_halving_min_iter, FLAGS_num_iter);
+  }
+  for (int round = 0;; ++round) {
+    ParallelFor(0, remaining.size(), num_threads, [&](int i) {
+      remaining[i]->round = round;
+      TrainGridCell(data, round_iter, remaining[i]);
+    });
+    LOG(INFO) << "Trained " << remaining.size() << " models for " << round_iter
+              << " iterations.";
+    if (round_iter == FLAGS_num_iter) break;
+    std::stable_sort(remaining.begin(), remaining.end(), IsBetterCell);
+    const int num_kept =
+        std::max<int>(1, remaining.size() / FLAGS_halving_factor);
+    for (size_t i = num_kept; i < remaining.size(); ++i) {
+      remaining[i]->trainer.reset();
+    }
+    remaining.resize(num_kept);
+    round_iter = std::min<long>(FLAGS_num_iter,
+                                static_cast<long>(round_iter) *
+                                    FLAGS_halving_factor);
+  }
+}
+
+// Return the value of path_param in params.
+float PathParam(const BoostParams& params) {
+  return FLAGS_path_param == "lambda" ? params.tree_params.lambda
+                                      : params.tree_params.beta;
+}
+
+// Train the cells along regularization paths over path_param. The cells of a
+// path are trained in order by one trainer, which only changes beta and lambda
+// between them, so each starts from the model, example weights and margins of
+// the one before. Different paths are trained at the same time.
+void TrainGridPaths(const GridData& data, int num_threads,
+                    vector<GridCell>* cells) {
+  // The cells of each path, keyed by the hyperparameters they share.
+  std::map<std::tuple<int, float, string>, vector<GridCell*>> path_map;
+  for (GridCell& cell : *cells) {
+    const TreeParams& tree_params = cell.params.tree_params;
+    const float other_param = FLAGS_path_param == "lambda" ? tree_params.beta
+                                                           : tree_params.lambda;
+    path_map[std::make_tuple(tree_params.tree_depth, other_param,
+                             cell.params.loss_type)]
+        .push_back(&cell);
+  }
+  vector<vector<GridCell*>> paths;
+  for (auto& key_and_path : path_map) {
+    vector<GridCell*>& path = key_and_path.second;
+    std::stable_sort(path.begin(), path.end(),
+                     [](const GridCell* a, const GridCell* b) {
+                       return PathParam(a->params) > PathParam(b->params);
+                     });
+    paths.push_back(std::move(path));
+  }
+  const int path_iter = FLAGS_path_iter > 0 ? FLAGS_path_iter
+                                            : std::max(1, FLAGS_num_iter / 10);
+  ParallelFor(0, paths.size(), num_threads, [&](int i) {
+    const vector<GridCell*>& path = paths[i];
+    TrainGridCell(data, FLAGS_num_iter, path[0]);
+    for (size_t j = 1; j < path.size(); ++j) {
+      const GridCell& previous = *path[j - 1];
+      GridCell* cell = path[j];
+      cell->trainer = previous.trainer;
+      cell->cv_margins = previous.cv_margins;
+      cell->test_margins = previous.test_margins;
+      cell->num_iter = previous.num_iter;
+      cell->trainer->SetRegularization(cell->params.tree_params.beta,
+                                       cell->params.tree_params.lambda);
+      TrainGridCell(data, cell->num_iter + path_iter, cell);
+    }
+  });
+  LOG(INFO) << "Trained " << cells->size() << " models along " << paths.size()
+            << " paths.";
+}
+
+// Write cells to file as a table, one cell per line, best cell first.
+void WriteResults(const vector<GridCell>& cells, FILE* file) {
+  vector<const GridCell*> sorted_cells;
+  for (const GridCell& cell : cells) sorted_cells.push_back(&cell);
+  // Ties keep the order the cells were made in.
+  std::stable_sort(sorted_cells.begin(), sorted_cells.end(), IsBetterCell);
+  fprintf(file, "%-12s %-12s %-10s %-11s %-8s %-10s %-10s %-13s %s\n",
+          "beta", "lambda", "tree_depth", "loss_type", "num_iter", "cv_error",
+          "test_error", "avg_tree_size", "num_trees");
+  for (const GridCell* cell : sorted_cells) {
+    const TreeParams& tree_params = cell->params.tree_params;
+    fprintf(file, "%-12g %-12g %-10d %-11s %-8d %-10g %-10g %-13g %d\n",
+            tree_params.beta, tree_params.lambda, tree_params.tree_depth,
+            cell->params.loss_type.c_str(), cell->num_iter, cell->cv_error,
+            cell->test_error, cell->avg_tree_size, cell->num_trees);
+  }
+}
+
+// Write the model of every cell that has one to a file named after
+// model_out_prefix and the cell's hyperparameters.
+void WriteModels(const vector<GridCell>& cells) {
+  for (const GridCell& cell : cells) {
+    if (cell.trainer == nullptr) continue;
+    Model model = cell.trainer->model();
+    RestoreModel(cell.tree_weights, &model);
+    const TreeParams& tree_params = cell.params.tree_params;
+    char suffix[128];
+    snprintf(suffix, sizeof(suffix), "beta_%g_lambda_%g_depth_%d_%s",
+             tree_params.beta, tree_params.lambda, tree_params.tree_depth,
+             cell.params.loss_type.c_str());
+    SaveModel(model, FLAGS_model_out_prefix + suffix);
+  }
+}
+
+void ValidateFlags() {
+  CHECK_GE(FLAGS_num_iter, 1);
+  CHECK(!FLAGS_data_filename.empty());
+  CHECK_GE(FLAGS_num_folds, 3);
+  CHECK_GE(FLAGS_fold_to_cv, 0);
+  CHECK_GE(FLAGS_fold_to_test, 0);
+  CHECK_LE(FLAGS_fold_to_cv, FLAGS_num_folds - 1);
+  CHECK_LE(FLAGS_fold_to_test, FLAGS_num_folds - 1);
+  CHECK_GE(FLAGS_seed, 0);
+  CHECK(FLAGS_split_mode == "exact" || FLAGS_split_mode == "histogram");
+  CHECK_GE(FLAGS_max_bins, 2);
+  CHECK_LE(FLAGS_max_bins, 255);
+  CHECK(FLAGS_growth == "breadth_first" || FLAGS_growth == "level_wise" ||
+        FLAGS_growth == "best_first");
+  CHECK_GE(FLAGS_max_leaves, 1);
+  CHECK_GE(FLAGS_grid_threads, 0);
+  CHECK_GE(FLAGS_halving_min_iter, 0);
+  CHECK_GE(FLAGS_halving_factor, 2);
+  CHECK(FLAGS_path_param.empty() || FLAGS_path_param == "lambda" ||
+        FLAGS_path_param == "beta");
+  CHECK(FLAGS_path_param.empty() || FLAGS_halving_min_iter == 0);
+  CHECK_GE(FLAGS_path_iter, 0);
+}
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  ValidateFlags();
+
+  SetSeed(FLAGS_seed);
+
+  vector<GridCell> cells;
+  MakeGridCells(&cells);
+
+  // The column index only depends on split_mode and max_bins, which are the
+  // same for every cell.
+  GridData data;
+  ReadData(&data.train_examples, &data.cv_examples, &data.test_examples,
+           &data.train_data, &data.train_index);
+
+  int num_threads = FLAGS_grid_threads;
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (FLAGS_path_param.empty()) {
+    TrainGridCells(data, num_threads, &cells);
+  } else {
+    TrainGridPaths(data, num_threads, &cells);
+  }
+
+  FILE* file = stdout;
+  if (!FLAGS_results_filename.empty()) {
+    file = fopen(FLAGS_results_filename.c_str(), "w");
+    CHECK(file != nullptr) << "Could not open " << FLAGS_results_filename;
+  }
+  WriteResults(cells, file);
+  if (file != stdout) fclose(file);
+
+  if (!FLAGS_model_out_prefix.empty()) WriteModels(cells);
+}
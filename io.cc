@@ -22,6 +22,7 @@ limitations under the License.
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
+#include "tree.h"
 
 DEFINE_string(data_set, "mnist17",
               "Name of data set. Required: One of breastcancer, wpbc, mnist17, ionosphere, "
@@ -306,56 +307,64 @@ bool ParseLineMnist(const string& line, Example* example) {
   return true;
 }
 
-void ReadData(vector<Example>* train_examples,
-              vector<Example>* cv_examples,
-              vector<Example>* test_examples) {
-  train_examples->clear();
-  cv_examples->clear();
-  test_examples->clear();
-  vector<Example> examples;
+bool ParseLine(const string& line, Example* example) {
+  if (FLAGS_data_set == "breastcancer") {
+    return ParseLineBreastCancer(line, example);
+  } else if (FLAGS_data_set == "wpbc") {  // 添加这个分支
+    return ParseLineWpbc(line, example);
+  } else if (FLAGS_data_set == "mnist17") {  // 新添加
+    return ParseLineMnist(line, example);
+  } else if (FLAGS_data_set == "ionosphere") {
+    return ParseLineIon(line, example);
+  } else if (FLAGS_data_set == "german") {
+    return ParseLineGerman(line, example);
+  } else if (FLAGS_data_set == "ocr17-mnist") {
+    return ParseLineOcr17(line, example);
+  } else if (FLAGS_data_set == "ocr49-mnist") {
+    return ParseLineOcr49(line, example);
+  } else if (FLAGS_data_set == "ocr17") {
+    return ParseLineOcr17Princeton(line, example);
+  } else if (FLAGS_data_set == "ocr49") {
+    return ParseLineOcr49Princeton(line, example);
+  } else if (FLAGS_data_set == "diabetes") {
+    return ParseLinePima(line, example);
+  } else {
+    LOG(FATAL) << "Unknown data set: " << FLAGS_data_set;
+  }
+  return false;
+}
+
+void ReadExamples(vector<Example>* examples) {
+  examples->clear();
   std::ifstream file(FLAGS_data_filename);
   CHECK(file.is_open());
   string line;
   while (!std::getline(file, line).eof()) {
     Example example;
-    bool keep_example;
-    if (FLAGS_data_set == "breastcancer") {
-      keep_example = ParseLineBreastCancer(line, &example);
-    } else if (FLAGS_data_set == "wpbc") {  // 添加这个分支
-      keep_example = ParseLineWpbc(line, &example);
-    } else if (FLAGS_data_set == "mnist17") {  // 新添加
-      keep_example = ParseLineMnist(line, &example);
-    } else if (FLAGS_data_set == "ionosphere") {
-      keep_example = ParseLineIon(line, &example);
-    } else if (FLAGS_data_set == "german") {
-      keep_example = ParseLineGerman(line, &example);
-    } else if (FLAGS_data_set == "ocr17-mnist") {
-      keep_example = ParseLineOcr17(line, &example);
-    } else if (FLAGS_data_set == "ocr49-mnist") {
-      keep_example = ParseLineOcr49(line, &example);
-    } else if (FLAGS_data_set == "ocr17") {
-      keep_example = ParseLineOcr17Princeton(line, &example);
-    } else if (FLAGS_data_set == "ocr49") {
-      keep_example = ParseLineOcr49Princeton(line, &example);
-    } else if (FLAGS_data_set == "diabetes") {
-      keep_example = ParseLinePima(line, &example);
-    } else {
-      LOG(FATAL) << "Unknown data set: " << FLAGS_data_set;
-    }
-    if (keep_example) examples.push_back(example);
+    if (ParseLine(line, &example)) examples->push_back(example);
   }
-  std::shuffle(examples.begin(), examples.end(), rng);
+  std::shuffle(examples->begin(), examples->end(), rng);
   std::uniform_real_distribution<double> dist;
-  int fold = 0;
-  // TODO(usyed): Two loops is inefficient
-  for (Example& example : examples) {
+  for (Example& example : *examples) {
     double r = dist(rng);
     if (r < FLAGS_noise_prob) {
       example.label = -example.label;
     }
-    if (fold == FLAGS_fold_to_test) {
+  }
+}
+
+void SplitExamples(const vector<Example>& examples, int fold_to_cv,
+                   int fold_to_test, vector<Example>* train_examples,
+                   vector<Example>* cv_examples,
+                   vector<Example>* test_examples) {
+  train_examples->clear();
+  cv_examples->clear();
+  test_examples->clear();
+  int fold = 0;
+  for (const Example& example : examples) {
+    if (fold == fold_to_test) {
       test_examples->push_back(example);
-    } else if (fold == FLAGS_fold_to_cv) {
+    } else if (fold == fold_to_cv) {
       cv_examples->push_back(example);
     } else {
       train_examples->push_back(example);
@@ -364,10 +373,19 @@ void ReadData(vector<Example>* train_examples,
     if (fold == FLAGS_num_folds) fold = 0;
   }
   const float initial_wgt = 1.0 / train_examples->size();
-  // TODO(usyed): Three loops is _really_ inefficient
+  // TODO(usyed): Two loops is inefficient
   for (Example& example : *train_examples) {
     example.weight = initial_wgt;
   }
+}
+
+void ReadData(vector<Example>* train_examples,
+              vector<Example>* cv_examples,
+              vector<Example>* test_examples) {
+  vector<Example> examples;
+  ReadExamples(&examples);
+  SplitExamples(examples, FLAGS_fold_to_cv, FLAGS_fold_to_test,
+                train_examples, cv_examples, test_examples);
 
   // 在return;之前添加这些代码
   LOG(INFO) << "Dataset statistics:";
@@ -400,3 +418,14 @@ void ReadData(vector<Example>* train_examples,
 
   return;
 }
+
+void ReadData(vector<Example>* train_examples,
+              vector<Example>* cv_examples,
+              vector<Example>* test_examples,
+              ColumnarDataset* train_data,
+              ColumnIndex* train_index) {
+  ReadData(train_examples, cv_examples, test_examples);
+  MakeColumnarDataset(*train_examples, train_data);
+  MakeColumnIndex(TreeParamsFromFlags(), *train_data, train_index);
+  DropBinnedValues(*train_index, train_data);
+}
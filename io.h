@@ -49,9 +49,35 @@ bool ParseLinePima(const string& line, Example* example);
 
 bool ParseLineMnist(const string& line, Example* example);
 
-// Read data set into training set, cross-validation set and test set.
+// Parse one line of data set data_set with the function above for it. Return
+// whether the line holds an example.
+bool ParseLine(const string& line, Example* example);
+
+// Read data set into examples, shuffle them, and flip the label of each one
+// with probability noise_prob. Example i belongs to fold i % num_folds.
+void ReadExamples(vector<Example>* examples);
+
+// Split examples read by ReadExamples() into training set, cross-validation set
+// (fold fold_to_cv) and test set (fold fold_to_test). The training examples are
+// weighted uniformly.
+void SplitExamples(const vector<Example>& examples, int fold_to_cv,
+                   int fold_to_test, vector<Example>* train_examples,
+                   vector<Example>* cv_examples,
+                   vector<Example>* test_examples);
+
+// Read data set into training set, cross-validation set and test set, i.e.,
+// ReadExamples() followed by SplitExamples() with fold_to_cv and fold_to_test.
 void ReadData(vector<Example>* train_examples,
               vector<Example>* cv_examples,
               vector<Example>* test_examples);
 
+// Same as above, and also store the training set column by column in
+// train_data, and build its column index. In histogram mode train_data then
+// keeps no values; see DropBinnedValues().
+void ReadData(vector<Example>* train_examples,
+              vector<Example>* cv_examples,
+              vector<Example>* test_examples,
+              ColumnarDataset* train_data,
+              ColumnIndex* train_index);
+
 #endif  // IO_H_
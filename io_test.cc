@@ -266,6 +266,31 @@ TEST_F(IoTest, ReadDataTest) {
   EXPECT_NEAR(0.5, train_examples[1].weight, kTolerance);
 }
 
+TEST_F(IoTest, SplitExamplesTest) {
+  FLAGS_num_folds = 3;
+  // examples_ holds 5 examples, so folds 0 and 1 hold two examples each and
+  // fold 2 holds one.
+  vector<Example> train_examples, cv_examples, test_examples;
+  SplitExamples(examples_, 2, 0, &train_examples, &cv_examples,
+                &test_examples);
+  ASSERT_EQ(2, train_examples.size());
+  ASSERT_EQ(1, cv_examples.size());
+  ASSERT_EQ(2, test_examples.size());
+  EXPECT_EQ(examples_[1].values, train_examples[0].values);
+  EXPECT_EQ(examples_[4].values, train_examples[1].values);
+  EXPECT_EQ(examples_[2].values, cv_examples[0].values);
+  EXPECT_EQ(examples_[0].values, test_examples[0].values);
+  EXPECT_EQ(examples_[3].values, test_examples[1].values);
+  EXPECT_NEAR(0.5, train_examples[0].weight, kTolerance);
+  EXPECT_NEAR(0.5, train_examples[1].weight, kTolerance);
+  // Every example is in exactly one of the sets.
+  SplitExamples(examples_, 0, 1, &train_examples, &cv_examples,
+                &test_examples);
+  EXPECT_EQ(examples_.size(), train_examples.size() + cv_examples.size() +
+                                  test_examples.size());
+  FLAGS_num_folds = 5;
+}
+
 TEST_F(IoTest, ReadDataTestWithNoise) {
   FLAGS_data_set = "breastcancer";
   FLAGS_data_filename = "./testdata/breast-cancer-wisconsin.data";
@@ -0,0 +1,286 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "model_io.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+
+#include "glog/logging.h"
+
+// Size of the header, of the entry of one tree, and of one node.
+static const int kHeaderSize = 16;
+static const int kTreeSize = 8;
+static const int kNodeSize = 16;
+static_assert(sizeof(FlatModelHeader) == kHeaderSize, "Unexpected padding");
+static_assert(sizeof(FlatTree) == kTreeSize, "Unexpected padding");
+static_assert(sizeof(FlatNode) == kNodeSize, "Unexpected padding");
+
+// Write value at out as 4 little-endian bytes.
+static void PutUint32(uint32_t value, char* out) {
+  for (int i = 0; i < 4; ++i) out[i] = static_cast<char>(value >> (8 * i));
+}
+
+static void PutInt32(int32_t value, char* out) {
+  PutUint32(static_cast<uint32_t>(value), out);
+}
+
+static void PutFloat(float value, char* out) {
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  PutUint32(bits, out);
+}
+
+// Return the 4 little-endian bytes at in.
+static uint32_t GetUint32(const char* in) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(in);
+  return static_cast<uint32_t>(bytes[0]) |
+         static_cast<uint32_t>(bytes[1]) << 8 |
+         static_cast<uint32_t>(bytes[2]) << 16 |
+         static_cast<uint32_t>(bytes[3]) << 24;
+}
+
+static int32_t GetInt32(const char* in) {
+  return static_cast<int32_t>(GetUint32(in));
+}
+
+static float GetFloat(const char* in) {
+  const uint32_t bits = GetUint32(in);
+  float value;
+  memcpy(&value, &bits, 4);
+  return value;
+}
+
+void SerializeModel(const Model& model, string* bytes) {
+  int num_nodes = 0;
+  for (const pair<Weight, Tree>& wgtd_tree : model) {
+    num_nodes += wgtd_tree.second.size();
+  }
+  bytes->resize(kHeaderSize + kTreeSize * model.size() +
+                kNodeSize * num_nodes);
+  char* out = &(*bytes)[0];
+  memcpy(out, kModelMagic, 4);
+  PutUint32(kModelFormatVersion, out + 4);
+  PutUint32(model.size(), out + 8);
+  PutUint32(num_nodes, out + 12);
+  out += kHeaderSize;
+  int root = 0;
+  for (const pair<Weight, Tree>& wgtd_tree : model) {
+    PutFloat(wgtd_tree.first, out);
+    PutUint32(root, out + 4);
+    root += wgtd_tree.second.size();
+    out += kTreeSize;
+  }
+  for (const pair<Weight, Tree>& wgtd_tree : model) {
+    for (const Node& node : wgtd_tree.second) {
+      if (node.leaf) {
+        PutInt32(-1, out);
+        PutFloat(node.label, out + 4);
+        PutInt32(-1, out + 8);
+        PutInt32(-1, out + 12);
+      } else {
+        PutInt32(node.split_feature, out);
+        PutFloat(node.split_value, out + 4);
+        PutInt32(node.left_child_id, out + 8);
+        PutInt32(node.right_child_id, out + 12);
+      }
+      out += kNodeSize;
+    }
+  }
+}
+
+// Check the header of the model of size bytes at in, and set the number of
+// trees and nodes of the model.
+static void CheckHeader(const char* in, size_t size, uint32_t* num_trees,
+                        uint32_t* num_nodes) {
+  CHECK_GE(size, kHeaderSize) << "Truncated model";
+  CHECK(memcmp(in, kModelMagic, 4) == 0) << "Not a model";
+  CHECK_EQ(GetUint32(in + 4), kModelFormatVersion)
+      << "Unsupported model format version";
+  *num_trees = GetUint32(in + 8);
+  *num_nodes = GetUint32(in + 12);
+  const uint64_t expected_size = kHeaderSize +
+                                 kTreeSize * uint64_t{*num_trees} +
+                                 kNodeSize * uint64_t{*num_nodes};
+  CHECK_EQ(size, expected_size) << "Truncated model";
+}
+
+// Check that a tree whose nodes are root, ..., end - 1 of num_nodes nodes is
+// not empty, fits, and has few enough nodes for a NodeId to number them.
+static void CheckTree(uint64_t root, uint64_t end, uint32_t num_nodes) {
+  CHECK_LT(root, end) << "Empty tree";
+  CHECK_LE(end, num_nodes) << "Bad number of nodes";
+  const uint64_t max_tree_size = std::numeric_limits<NodeId>::max();
+  CHECK_LE(end - root, max_tree_size) << "Tree too large";
+}
+
+// Check node node_id of a tree of tree_size nodes. Children come after their
+// parent, so classifying always ends at a leaf.
+static void CheckNode(int32_t split_feature, int32_t left_child_id,
+                      int32_t right_child_id, NodeId node_id,
+                      int tree_size) {
+  if (left_child_id == -1) return;
+  CHECK_GE(split_feature, 0) << "Bad split feature";
+  CHECK(left_child_id > node_id && left_child_id < tree_size &&
+        right_child_id > node_id && right_child_id < tree_size)
+      << "Bad child id";
+}
+
+void ParseModel(const string& bytes, Model* model) {
+  model->clear();
+  const char* in = bytes.data();
+  uint32_t num_trees, num_nodes;
+  CheckHeader(in, bytes.size(), &num_trees, &num_nodes);
+  const char* tree_in = in + kHeaderSize;
+  const char* node_in = tree_in + kTreeSize * num_trees;
+  // The trees are stored one after the other.
+  uint64_t end = 0;
+  model->resize(num_trees);
+  for (uint32_t tree_id = 0; tree_id < num_trees; ++tree_id) {
+    pair<Weight, Tree>& wgtd_tree = (*model)[tree_id];
+    wgtd_tree.first = GetFloat(tree_in);
+    const uint64_t root = end;
+    CHECK_EQ(GetUint32(tree_in + 4), root) << "Bad tree root";
+    end = tree_id + 1 < num_trees ? GetUint32(tree_in + kTreeSize + 4)
+                                  : num_nodes;
+    tree_in += kTreeSize;
+    CheckTree(root, end, num_nodes);
+    const int tree_size = end - root;
+    Tree& tree = wgtd_tree.second;
+    tree.resize(tree_size);
+    for (NodeId node_id = 0; node_id < tree_size; ++node_id) {
+      Node& node = tree[node_id];
+      node.split_feature = GetInt32(node_in);
+      node.split_value = GetFloat(node_in + 4);
+      node.left_child_id = GetInt32(node_in + 8);
+      node.right_child_id = GetInt32(node_in + 12);
+      node_in += kNodeSize;
+      CheckNode(node.split_feature, node.left_child_id, node.right_child_id,
+                node_id, tree_size);
+      node.leaf = node.left_child_id == -1;
+      if (node.leaf) {
+        node.label = node.split_value < 0 ? -1 : 1;
+        node.split_value = 0;
+      } else {
+        node.label = 0;
+      }
+    }
+  }
+  CHECK_EQ(end, num_nodes) << "Bad number of nodes";
+}
+
+void SaveModel(const Model& model, const string& filename) {
+  string bytes;
+  SerializeModel(model, &bytes);
+  std::ofstream file(filename, std::ios::binary);
+  CHECK(file.is_open()) << "Could not open " << filename;
+  file.write(bytes.data(), bytes.size());
+  CHECK(file.good()) << "Could not write " << filename;
+}
+
+void LoadModel(const string& filename, Model* model) {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  CHECK(file.is_open()) << "Could not open " << filename;
+  string bytes(static_cast<size_t>(file.tellg()), '\0');
+  file.seekg(0);
+  file.read(&bytes[0], bytes.size());
+  CHECK(file.good()) << "Could not read " << filename;
+  ParseModel(bytes, model);
+}
+
+MappedModel::MappedModel(const string& filename) {
+  const uint32_t one = 1;
+  CHECK_EQ(*reinterpret_cast<const char*>(&one), 1)
+      << "MappedModel requires a little-endian machine";
+  const int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "Could not open " << filename;
+  struct stat file_stat;
+  CHECK_EQ(fstat(fd, &file_stat), 0) << "Could not stat " << filename;
+  size_ = file_stat.st_size;
+  CHECK_GE(size_, kHeaderSize) << "Truncated model";
+  mapping_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  CHECK(mapping_ != MAP_FAILED) << "Could not map " << filename;
+  // The mapping stays valid after the file is closed.
+  close(fd);
+
+  const char* in = static_cast<const char*>(mapping_);
+  uint32_t num_trees, num_nodes;
+  CheckHeader(in, size_, &num_trees, &num_nodes);
+  header_ = reinterpret_cast<const FlatModelHeader*>(in);
+  trees_ = reinterpret_cast<const FlatTree*>(in + kHeaderSize);
+  nodes_ = reinterpret_cast<const FlatNode*>(in + kHeaderSize +
+                                             kTreeSize * num_trees);
+  validated_ = false;
+  max_split_feature_ = -1;
+}
+
+MappedModel::~MappedModel() { munmap(const_cast<void*>(mapping_), size_); }
+
+void MappedModel::Validate() {
+  // Checking every node reads the whole file once, which also brings it into
+  // the page cache for the first process that maps it.
+  const uint32_t num_trees = header_->num_trees;
+  const uint32_t num_nodes = header_->num_nodes;
+  max_split_feature_ = -1;
+  uint64_t end = 0;
+  for (uint32_t tree_id = 0; tree_id < num_trees; ++tree_id) {
+    const uint64_t root = end;
+    CHECK_EQ(trees_[tree_id].root, root) << "Bad tree root";
+    end = tree_id + 1 < num_trees ? trees_[tree_id + 1].root : num_nodes;
+    CheckTree(root, end, num_nodes);
+    const int tree_size = end - root;
+    const FlatNode* tree = nodes_ + root;
+    for (NodeId node_id = 0; node_id < tree_size; ++node_id) {
+      const FlatNode& node = tree[node_id];
+      CheckNode(node.split_feature, node.left_child_id, node.right_child_id,
+                node_id, tree_size);
+      max_split_feature_ = std::max(max_split_feature_, node.split_feature);
+    }
+  }
+  CHECK_EQ(end, num_nodes) << "Bad number of nodes";
+  validated_ = true;
+}
+
+Feature MappedModel::max_split_feature() const {
+  CHECK(validated_) << "MappedModel::Validate() was not called";
+  return max_split_feature_;
+}
+
+float MappedModel::ScoreExample(const Example& example) const {
+  float score = 0;
+  for (uint32_t tree_id = 0; tree_id < header_->num_trees; ++tree_id) {
+    const FlatTree& tree = trees_[tree_id];
+    const FlatNode* root = nodes_ + tree.root;
+    const FlatNode* node = root;
+    while (node->left_child_id != -1) {
+      if (example.values[node->split_feature] <= node->split_value) {
+        node = root + node->left_child_id;
+      } else {
+        node = root + node->right_child_id;
+      }
+    }
+    // A leaf holds its label in place of the split value.
+    score += tree.weight * node->split_value;
+  }
+  return score;
+}
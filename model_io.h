@@ -0,0 +1,120 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef MODEL_IO_H_
+#define MODEL_IO_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "types.h"
+
+using std::string;
+
+// The binary model format. It is flat and position-independent, so that a
+// model file can be mapped into memory and scored in place by MappedModel.
+// Every field is 4 bytes, little-endian, and each section is an array of the
+// struct of the same name below:
+//
+//   header: magic "DBMD", version, number of trees, total number of nodes
+//   trees:  for each tree, its weight and the index of its root in nodes
+//   nodes:  for each tree in order, for each node in order, split feature,
+//           split value, left child id and right child id
+//
+// Only what classifying an example needs is stored. A leaf has split feature
+// and child ids -1, and its label in place of the split value. Child ids are
+// relative to the root of the tree, and always greater than the id of their
+// parent. Only kModelFormatVersion is accepted.
+static const char kModelMagic[4] = {'D', 'B', 'M', 'D'};
+static const uint32_t kModelFormatVersion = 2;
+
+typedef struct FlatModelHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_trees;
+  uint32_t num_nodes;
+} FlatModelHeader;
+
+typedef struct FlatTree {
+  float weight;
+  uint32_t root;
+} FlatTree;
+
+typedef struct FlatNode {
+  int32_t split_feature;
+  float split_value;
+  int32_t left_child_id;
+  int32_t right_child_id;
+} FlatNode;
+
+// Set bytes to model in the binary model format.
+void SerializeModel(const Model& model, string* bytes);
+
+// Set model to the model in bytes, which must be in the binary model format.
+// Nodes other than leaves get label 0, since only leaves predict labels.
+void ParseModel(const string& bytes, Model* model);
+
+// Write model to file filename in the binary model format.
+void SaveModel(const Model& model, const string& filename);
+
+// Read model from file filename, written by SaveModel().
+void LoadModel(const string& filename, Model* model);
+
+// A model file written by SaveModel(), mapped read-only into memory. Examples
+// are scored straight from the mapped file, so the processes that map the same
+// file share one copy of it in the page cache, and opening a model reads only
+// its header. Requires a little-endian machine.
+class MappedModel {
+ public:
+  // Map file filename, and check its header and size.
+  explicit MappedModel(const string& filename);
+  ~MappedModel();
+
+  MappedModel(const MappedModel&) = delete;
+  MappedModel& operator=(const MappedModel&) = delete;
+
+  // Same as ScoreExample() on the model.
+  float ScoreExample(const Example& example) const;
+
+  int num_trees() const { return header_->num_trees; }
+
+  // Check that every tree and node of the model is well formed, which reads
+  // the whole file, and find max_split_feature(). Scoring examples with a
+  // model that was not validated is only safe if its file is trusted.
+  void Validate();
+
+  // The largest feature any node splits on, or -1 if there is none. Requires
+  // Validate().
+  Feature max_split_feature() const;
+
+  // Whether example has every feature the model splits on, so that it can be
+  // scored. Requires Validate().
+  bool HasFeatures(const Example& example) const {
+    return max_split_feature() < static_cast<Feature>(example.values.size());
+  }
+
+ private:
+  const void* mapping_;
+  size_t size_;
+  const FlatModelHeader* header_;
+  const FlatTree* trees_;
+  const FlatNode* nodes_;
+  bool validated_;
+  Feature max_split_feature_;
+};
+
+#endif  // MODEL_IO_H_
@@ -0,0 +1,201 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "model_io.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include "boost.h"
+#include "tree.h"
+#include "srm_test.h"
+
+#include "gflags/gflags.h"
+#include "gtest/gtest.h"
+
+DECLARE_int32(tree_depth);
+DECLARE_double(beta);
+DECLARE_double(lambda);
+DECLARE_string(loss_type);
+
+class ModelIoTest : public SrmTest {
+ protected:
+  virtual void SetUp() {
+    SrmTest::SetUp();
+    FLAGS_tree_depth = 2;
+    FLAGS_beta = 0;
+    FLAGS_lambda = 0;
+    FLAGS_loss_type = "exponential";
+    ColumnarDataset data;
+    MakeColumnarDataset(examples_, &data);
+    DeepBoostTrainer trainer(BoostParamsFromFlags(), data);
+    for (int iter = 0; iter < 3; ++iter) {
+      trainer.AddTree();
+    }
+    model_ = trainer.model();
+  }
+
+  // Expect model to classify like model_ and to have the same weights and
+  // nodes, where only the labels of leaves count.
+  void ExpectSameModel(const Model& model) {
+    ASSERT_EQ(model_.size(), model.size());
+    for (size_t i = 0; i < model.size(); ++i) {
+      EXPECT_EQ(model_[i].first, model[i].first);
+      const Tree& expected_tree = model_[i].second;
+      const Tree& tree = model[i].second;
+      ASSERT_EQ(expected_tree.size(), tree.size());
+      for (size_t j = 0; j < tree.size(); ++j) {
+        EXPECT_EQ(expected_tree[j].leaf, tree[j].leaf);
+        EXPECT_EQ(expected_tree[j].split_feature, tree[j].split_feature);
+        EXPECT_EQ(expected_tree[j].split_value, tree[j].split_value);
+        EXPECT_EQ(expected_tree[j].left_child_id, tree[j].left_child_id);
+        EXPECT_EQ(expected_tree[j].right_child_id, tree[j].right_child_id);
+        if (tree[j].leaf) {
+          EXPECT_EQ(expected_tree[j].label, tree[j].label);
+        }
+      }
+    }
+    for (const Example& example : examples_) {
+      EXPECT_EQ(ScoreExample(example, model_), ScoreExample(example, model));
+    }
+  }
+
+  Model model_;
+};
+
+TEST_F(ModelIoTest, SerializeAndParseModel) {
+  string bytes;
+  SerializeModel(model_, &bytes);
+  int num_nodes = 0;
+  for (const pair<Weight, Tree>& wgtd_tree : model_) {
+    num_nodes += wgtd_tree.second.size();
+  }
+  EXPECT_EQ(16 + 8 * model_.size() + 16 * num_nodes, bytes.size());
+  Model model;
+  ParseModel(bytes, &model);
+  ExpectSameModel(model);
+}
+
+TEST_F(ModelIoTest, SerializeAndParseEmptyModel) {
+  string bytes;
+  SerializeModel(Model(), &bytes);
+  EXPECT_EQ(16, bytes.size());
+  Model model = model_;
+  ParseModel(bytes, &model);
+  EXPECT_EQ(0, model.size());
+}
+
+TEST_F(ModelIoTest, SaveAndLoadModel) {
+  const string filename = ::testing::TempDir() + "model_io_test.model";
+  SaveModel(model_, filename);
+  Model model;
+  LoadModel(filename, &model);
+  ExpectSameModel(model);
+}
+
+TEST_F(ModelIoTest, ParseModelRejectsBadInput) {
+  string bytes;
+  SerializeModel(model_, &bytes);
+  Model model;
+  string bad_magic = bytes;
+  bad_magic[0] = 'X';
+  EXPECT_DEATH(ParseModel(bad_magic, &model), "Not a model");
+  string bad_version = bytes;
+  bad_version[4] = 3;
+  EXPECT_DEATH(ParseModel(bad_version, &model), "version");
+  bad_version[4] = 1;
+  EXPECT_DEATH(ParseModel(bad_version, &model), "version");
+  EXPECT_DEATH(ParseModel(bytes.substr(0, bytes.size() - 1), &model),
+               "Truncated");
+  // Point the left child of the root of the first tree back at the root.
+  string bad_child = bytes;
+  const int root_offset = 16 + 8 * model_.size();
+  ASSERT_FALSE(model_[0].second[0].leaf);
+  bad_child[root_offset + 8] = 0;
+  EXPECT_DEATH(ParseModel(bad_child, &model), "Bad child id");
+}
+
+TEST_F(ModelIoTest, MappedModel) {
+  const string filename = ::testing::TempDir() + "model_io_test.model";
+  SaveModel(model_, filename);
+  MappedModel mapped_model(filename);
+  mapped_model.Validate();
+  EXPECT_EQ(model_.size(), mapped_model.num_trees());
+  Feature max_split_feature = -1;
+  for (const pair<Weight, Tree>& wgtd_tree : model_) {
+    for (const Node& node : wgtd_tree.second) {
+      if (!node.leaf) {
+        max_split_feature = std::max(max_split_feature, node.split_feature);
+      }
+    }
+  }
+  EXPECT_EQ(max_split_feature, mapped_model.max_split_feature());
+  for (const Example& example : examples_) {
+    EXPECT_TRUE(mapped_model.HasFeatures(example));
+    EXPECT_EQ(ScoreExample(example, model_),
+              mapped_model.ScoreExample(example));
+  }
+  Example short_example = examples_[0];
+  short_example.values.resize(max_split_feature);
+  EXPECT_FALSE(mapped_model.HasFeatures(short_example));
+}
+
+TEST_F(ModelIoTest, MappedModelDepthZero) {
+  // No node of a model of depth 0 splits, so it can score any example.
+  FLAGS_tree_depth = 0;
+  ColumnarDataset data;
+  MakeColumnarDataset(examples_, &data);
+  DeepBoostTrainer trainer(BoostParamsFromFlags(), data);
+  trainer.AddTree();
+  const string filename = ::testing::TempDir() + "model_io_test_depth0.model";
+  SaveModel(trainer.model(), filename);
+  MappedModel mapped_model(filename);
+  mapped_model.Validate();
+  EXPECT_EQ(1, mapped_model.num_trees());
+  EXPECT_EQ(-1, mapped_model.max_split_feature());
+  for (const Example& example : examples_) {
+    EXPECT_TRUE(mapped_model.HasFeatures(example));
+    EXPECT_EQ(ScoreExample(example, trainer.model()),
+              mapped_model.ScoreExample(example));
+  }
+}
+
+TEST_F(ModelIoTest, MappedModelEmpty) {
+  const string filename = ::testing::TempDir() + "model_io_test_empty.model";
+  SaveModel(Model(), filename);
+  MappedModel mapped_model(filename);
+  mapped_model.Validate();
+  EXPECT_EQ(0, mapped_model.num_trees());
+  EXPECT_EQ(-1, mapped_model.max_split_feature());
+  EXPECT_TRUE(mapped_model.HasFeatures(examples_[0]));
+  EXPECT_EQ(0, mapped_model.ScoreExample(examples_[0]));
+}
+
+TEST_F(ModelIoTest, MappedModelValidate) {
+  // Opening a model checks only its header, and Validate() checks its nodes.
+  string bytes;
+  SerializeModel(model_, &bytes);
+  ASSERT_FALSE(model_[0].second[0].leaf);
+  bytes[16 + 8 * model_.size() + 8] = 0;
+  const string filename = ::testing::TempDir() + "model_io_test_bad.model";
+  std::ofstream file(filename, std::ios::binary);
+  file.write(bytes.data(), bytes.size());
+  file.close();
+  MappedModel mapped_model(filename);
+  EXPECT_EQ(model_.size(), mapped_model.num_trees());
+  EXPECT_DEATH(mapped_model.max_split_feature(), "Validate");
+  EXPECT_DEATH(mapped_model.Validate(), "Bad child id");
+}
@@ -0,0 +1,112 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "glog/logging.h"
+
+// One call of ParallelFor(). Workers join a job by claiming one of its places,
+// and the caller, which also runs it, waits only for the workers that joined.
+struct Job {
+  const std::function<void(int)>* fn;
+  std::atomic<int> next;
+  int end;
+  int places;  // Places still open to workers.
+  int active;  // Workers still running the job.
+  std::condition_variable done;
+};
+
+// Worker threads are started the first time they are needed and live until
+// the program exits, so that a ParallelFor per tree node stays cheap. The pool
+// is never destroyed, because its workers are still waiting on it at exit.
+// Calls from different threads run at the same time, each on workers of its
+// own: the pool grows to as many workers as all running calls have asked for.
+struct ThreadPool {
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  int num_workers = 0;
+  int num_reserved = 0;  // Workers asked for by the running calls.
+  std::deque<Job*> jobs;  // The jobs with open places, oldest first.
+};
+
+static ThreadPool* pool = new ThreadPool;
+static thread_local bool in_parallel_for = false;
+
+// Claim indices of job one at a time until none are left.
+static void RunJob(Job* job) {
+  for (int i = job->next++; i < job->end; i = job->next++) {
+    (*job->fn)(i);
+  }
+}
+
+static void WorkerLoop() {
+  in_parallel_for = true;
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  while (true) {
+    pool->work_ready.wait(lock, [] { return !pool->jobs.empty(); });
+    Job* job = pool->jobs.front();
+    if (--job->places == 0) pool->jobs.pop_front();
+    ++job->active;
+    lock.unlock();
+    RunJob(job);
+    lock.lock();
+    // Notified under the lock, so the caller cannot return and destroy job
+    // before this worker is done with it.
+    if (--job->active == 0) job->done.notify_all();
+  }
+}
+
+void ParallelFor(int begin, int end, int num_threads,
+                 const std::function<void(int)>& fn) {
+  CHECK_GE(num_threads, 1);
+  if (num_threads > end - begin) num_threads = end - begin;
+  if (num_threads <= 1 || in_parallel_for) {
+    for (int i = begin; i < end; ++i) fn(i);
+    return;
+  }
+  // The caller is one of the threads of its job.
+  Job job;
+  job.fn = &fn;
+  job.next = begin;
+  job.end = end;
+  job.places = num_threads - 1;
+  job.active = 0;
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->num_reserved += num_threads - 1;
+  for (; pool->num_workers < pool->num_reserved; ++pool->num_workers) {
+    std::thread(WorkerLoop).detach();
+  }
+  pool->jobs.push_back(&job);
+  lock.unlock();
+  pool->work_ready.notify_all();
+  in_parallel_for = true;
+  RunJob(&job);
+  in_parallel_for = false;
+  lock.lock();
+  // Every index has been claimed, so places no worker took are closed.
+  if (job.places > 0) {
+    pool->jobs.erase(std::find(pool->jobs.begin(), pool->jobs.end(), &job));
+  }
+  job.done.wait(lock, [&job] { return job.active == 0; });
+  pool->num_reserved -= num_threads - 1;
+}
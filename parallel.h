@@ -0,0 +1,30 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <functional>
+
+// Call fn(i) for every i in [begin, end), spread over num_threads threads
+// (the calling thread is one of them), and return when every call has
+// finished. The order of the calls is unspecified, so fn(i) must only write
+// state that belongs to i. A call made from inside fn runs serially. Calls
+// made from different threads run at the same time, on threads of their own.
+void ParallelFor(int begin, int end, int num_threads,
+                 const std::function<void(int)>& fn);
+
+#endif  // PARALLEL_H_
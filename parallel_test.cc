@@ -0,0 +1,75 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "parallel.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using std::vector;
+
+TEST(ParallelTest, TestParallelFor) {
+  for (int num_threads : {1, 2, 3, 8}) {
+    vector<int> calls(100, 0);
+    ParallelFor(10, 100, num_threads, [&](int i) { ++calls[i]; });
+    for (size_t i = 0; i < calls.size(); ++i) {
+      EXPECT_EQ(i < 10 ? 0 : 1, calls[i]);
+    }
+  }
+}
+
+TEST(ParallelTest, TestParallelForEmptyRange) {
+  int num_calls = 0;
+  ParallelFor(5, 5, 4, [&](int) { ++num_calls; });
+  EXPECT_EQ(0, num_calls);
+}
+
+TEST(ParallelTest, TestParallelForNested) {
+  vector<int> sums(8, 0);
+  ParallelFor(0, sums.size(), 4, [&](int i) {
+    ParallelFor(0, 10, 4, [&](int j) { sums[i] += j; });
+  });
+  for (int sum : sums) EXPECT_EQ(45, sum);
+}
+
+TEST(ParallelTest, TestParallelForConcurrentCallers) {
+  // Each call waits inside fn until the other call has started, which only
+  // happens if the two calls run at the same time. The wait is bounded, so
+  // that serialized calls fail the test instead of hanging it.
+  std::atomic<bool> started[2] = {{false}, {false}};
+  std::atomic<bool> waited_out[2] = {{false}, {false}};
+  auto call = [&](int caller) {
+    std::atomic<bool>& other_started = started[1 - caller];
+    ParallelFor(0, 4, 2, [&](int) {
+      started[caller] = true;
+      const auto deadline =
+          std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      while (!other_started && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+      }
+      if (!other_started) waited_out[caller] = true;
+    });
+  };
+  std::thread other(call, 1);
+  call(0);
+  other.join();
+  EXPECT_FALSE(waited_out[0]);
+  EXPECT_FALSE(waited_out[1]);
+}
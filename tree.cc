@@ -18,11 +18,19 @@ limitations under the License.
 #include <iostream>  // 放在文件顶部 if not already included
 #include <numeric> 
 #include "tree.h"
+#include "parallel.h"
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <queue>
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 DEFINE_double(beta, 5e-5, "beta parameter for gradient.");
 DEFINE_double(lambda, 5e-6, "lambda parameter for gradient.");
 DEFINE_int32(tree_depth, 4,
@@ -32,30 +40,182 @@ DEFINE_int32(tree_depth, 4,
 DEFINE_int32(max_features_per_split, 200,
              "Maximum number of features to consider per split. "
              "Set to 0 to use all features. Useful for high-dimensional data.");
+DEFINE_string(split_mode, "exact",
+              "How split values are found. exact considers every distinct "
+              "value of a feature; histogram quantizes each feature into at "
+              "most max_bins bins when the data is read, and considers only "
+              "bin boundaries. Required: One of exact, histogram.");
+DEFINE_int32(max_bins, 255,
+             "Maximum number of bins per feature when split_mode is "
+             "histogram. Required: 2 <= max_bins <= 255.");
+DEFINE_string(growth, "breadth_first",
+              "How trees are grown. breadth_first splits one node at a time "
+              "in breadth-first order; level_wise gathers what is needed to "
+              "split all nodes at one depth with one pass over the data, and "
+              "grows the same trees; best_first always splits the node "
+              "whose split increases the gradient the most, until a tree has "
+              "max_leaves leaves. Required: One of breadth_first, level_wise, "
+              "best_first.");
+DEFINE_int32(max_leaves, 16,
+             "Maximum number of leaves of each tree when growth is "
+             "best_first. Trees are also no deeper than tree_depth. "
+             "Required: max_leaves >= 1.");
+DEFINE_int32(num_threads, 1,
+             "Number of threads used to search for splits. The trained trees "
+             "do not depend on it. Required: num_threads >= 1.");
+
+TreeParams TreeParamsFromFlags() {
+  TreeParams params;
+  params.beta = FLAGS_beta;
+  params.lambda = FLAGS_lambda;
+  params.tree_depth = FLAGS_tree_depth;
+  params.max_features_per_split = FLAGS_max_features_per_split;
+  params.split_mode = FLAGS_split_mode;
+  params.max_bins = FLAGS_max_bins;
+  params.growth = FLAGS_growth;
+  params.max_leaves = FLAGS_max_leaves;
+  params.num_threads = FLAGS_num_threads;
+  return params;
+}
 
-// TODO(usyed): Global variables are bad style.
-static int num_features;
-static int num_examples;
-static float the_normalizer;
-static bool is_initialized = false;
+static float RademacherComplexity(const TreeContext& context, int tree_size) {
+  return sqrt(((2 * tree_size + 1) * (log(context.num_features + 2) / log(2)) *
+               log(context.num_examples)) /
+              context.num_examples);
+}
+
+void InitializeTreeContext(const TreeParams& params,
+                           const ColumnarDataset& data, float normalizer,
+                           TreeContext* context) {
+  CHECK_GE(data.num_examples, 1);
+  context->params = params;
+  context->num_examples = data.num_examples;
+  context->num_features = data.num_features;
+  context->normalizer = normalizer;
+  int max_tree_size = 2 << std::min(std::max(params.tree_depth, 0), 20);
+  if (params.growth == "best_first") {
+    max_tree_size = std::min(max_tree_size, 2 * params.max_leaves);
+  }
+  vector<float>& rademacher_complexities = context->rademacher_complexities;
+  rademacher_complexities.resize(max_tree_size + 2);
+  for (size_t tree_size = 0; tree_size < rademacher_complexities.size();
+       ++tree_size) {
+    rademacher_complexities[tree_size] =
+        RademacherComplexity(*context, tree_size);
+  }
+}
 
-void InitializeTreeData(const vector<Example>& examples, float normalizer) {
+void MakeColumnarDataset(const vector<Example>& examples,
+                         ColumnarDataset* data) {
   CHECK_GE(examples.size(), 1);
-  num_examples = examples.size();
-  num_features = examples[0].values.size();
-  the_normalizer = normalizer;
-  is_initialized = true;
+  data->num_examples = examples.size();
+  data->num_features = examples[0].values.size();
+  vector<Value>* values = new vector<Value>(
+      static_cast<size_t>(data->num_examples) * data->num_features);
+  data->labels.resize(data->num_examples);
+  data->weights.resize(data->num_examples);
+  for (ExampleId id = 0; id < data->num_examples; ++id) {
+    const Example& example = examples[id];
+    CHECK_EQ(static_cast<int>(example.values.size()), data->num_features);
+    for (Feature feature = 0; feature < data->num_features; ++feature) {
+      (*values)[static_cast<size_t>(feature) * data->num_examples + id] =
+          example.values[feature];
+    }
+    data->labels[id] = example.label;
+    data->weights[id] = example.weight;
+  }
+  data->values.reset(values);
 }
 
-Node MakeRootNode(const vector<Example>& examples) {
-  Node root;
-  root.examples = examples;
+// Quantize the values of feature into at most max_bins bins holding roughly
+// equal numbers of examples, and record the bins in index.
+static void MakeBins(const ColumnarDataset& data, Feature feature, int max_bins,
+                     ColumnIndex* index) {
+  const Value* column = data.column(feature);
+  vector<Value> values(column, column + data.num_examples);
+  std::sort(values.begin(), values.end());
+  // A bin is closed at a distinct value once it holds its share of the
+  // examples, or at every distinct value if there are few enough of them.
+  vector<Value>& bin_values = index->bin_values[feature];
+  bin_values.clear();
+  int num_distinct = 0;
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (i == 0 || values[i] != values[i - 1]) ++num_distinct;
+  }
+  const double examples_per_bin =
+      static_cast<double>(values.size()) / max_bins;
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (i + 1 < values.size() && values[i + 1] == values[i]) continue;
+    if (num_distinct <= max_bins || i + 1 == values.size() ||
+        i + 1 >= (bin_values.size() + 1) * examples_per_bin) {
+      bin_values.push_back(values[i]);
+    }
+  }
+  CHECK_LE(static_cast<int>(bin_values.size()), max_bins);
+  for (ExampleId id = 0; id < data.num_examples; ++id) {
+    index->bins[static_cast<size_t>(id) * index->num_features + feature] =
+        std::lower_bound(bin_values.begin(), bin_values.end(), column[id]) -
+        bin_values.begin();
+  }
+}
+
+void MakeColumnIndex(const TreeParams& params, const ColumnarDataset& data,
+                     ColumnIndex* index) {
+  CHECK_GE(data.num_examples, 1);
+  index->num_features = data.num_features;
+  index->sorted_ids.clear();
+  index->bins.clear();
+  index->bin_values.clear();
+  index->bin_offsets.clear();
+  if (params.split_mode == "histogram") {
+    CHECK_GE(params.max_bins, 2);
+    CHECK_LE(params.max_bins, 255);
+    index->bins.resize(static_cast<size_t>(data.num_examples) *
+                       data.num_features);
+    index->bin_values.resize(data.num_features);
+    index->bin_offsets.push_back(0);
+    for (Feature feature = 0; feature < data.num_features; ++feature) {
+      MakeBins(data, feature, params.max_bins, index);
+      index->bin_offsets.push_back(index->bin_offsets.back() +
+                                   index->bin_values[feature].size());
+    }
+    return;
+  }
+  CHECK_EQ(params.split_mode, "exact");
+  index->sorted_ids.resize(data.num_features);
+  for (Feature feature = 0; feature < data.num_features; ++feature) {
+    vector<ExampleId>& sorted_ids = index->sorted_ids[feature];
+    sorted_ids.resize(data.num_examples);
+    std::iota(sorted_ids.begin(), sorted_ids.end(), 0);
+    // Stable, so that the weights of examples with equal values are summed in
+    // the same order as in MakeValueToWeightsMap().
+    const Value* column = data.column(feature);
+    std::stable_sort(sorted_ids.begin(), sorted_ids.end(),
+                     [column](ExampleId a, ExampleId b) {
+                       return column[a] < column[b];
+                     });
+  }
+}
+
+void DropBinnedValues(const ColumnIndex& index, ColumnarDataset* data) {
+  if (!index.bins.empty()) data->values.reset();
+}
+
+TrainingNode MakeRootNode(const ColumnarDataset& data,
+                          ExamplePartition* partition) {
+  partition->example_ids.resize(data.num_examples);
+  std::iota(partition->example_ids.begin(), partition->example_ids.end(), 0);
+  partition->example_node.assign(data.num_examples, 0);
+  partition->scratch.resize(data.num_examples);
+  TrainingNode root;
+  root.begin = 0;
+  root.end = data.num_examples;
   root.positive_weight = root.negative_weight = 0;
-  for (const Example& example : examples) {
-    if (example.label == 1) {
-      root.positive_weight += example.weight;
+  for (ExampleId id = 0; id < data.num_examples; ++id) {
+    if (data.labels[id] == 1) {
+      root.positive_weight += data.weights[id];
     } else {  // label == -1
-      root.negative_weight += example.weight;
+      root.negative_weight += data.weights[id];
     }
   }
   root.leaf = true;
@@ -63,131 +223,1169 @@ Node MakeRootNode(const vector<Example>& examples) {
   return root;
 }
 
-map<Value, pair<Weight, Weight>> MakeValueToWeightsMap(const Node& node,
-                                                       Feature feature) {
+map<Value, pair<Weight, Weight>> MakeValueToWeightsMap(
+    const ColumnarDataset& data, const ExamplePartition& partition,
+    const TrainingNode& node, Feature feature) {
   map<Value, pair<Weight, Weight>> value_to_weights;
-  for (const Example& example : node.examples) {
-    if (example.label == 1) {
-      value_to_weights[example.values[feature]].first += example.weight;
+  const Value* column = data.column(feature);
+  for (int i = node.begin; i < node.end; ++i) {
+    const ExampleId id = partition.example_ids[i];
+    if (data.labels[id] == 1) {
+      value_to_weights[column[id]].first += data.weights[id];
     } else {  // label = -1
-      value_to_weights[example.values[feature]].second += example.weight;
+      value_to_weights[column[id]].second += data.weights[id];
     }
   }
   return value_to_weights;
 }
 
-void BestSplitValue(const map<Value, pair<Weight, Weight>>& value_to_weights,
-                    const Node& node, int tree_size, Value* split_value,
-                    float* delta_gradient) {
+// The candidate splits of one feature at one node, in increasing order of
+// value. Candidate i sends the examples with values <= values[i] to the left
+// child, and the children's weights are the i-th entries of the weight arrays.
+// Filled in by the BestSplitValue*() functions, which share ChooseSplit().
+typedef struct SplitCandidates {
+  vector<Value> values;
+  vector<Weight> left_positive_weights;
+  vector<Weight> left_negative_weights;
+  vector<Weight> right_positive_weights;
+  vector<Weight> right_negative_weights;
+  vector<float> delta_gradients;
+  // The children's weights for the candidate being added.
+  Weight left_positive_weight, left_negative_weight;
+  Weight right_positive_weight, right_negative_weight;
+} SplitCandidates;
+
+// Each thread reuses its own candidates, so that searching for a split
+// allocates nothing once the arrays have grown.
+static thread_local SplitCandidates thread_candidates;
+
+// See NumSortedIdsScanned(). Added to once per scan, not once per id.
+static std::atomic<int64_t> num_sorted_ids_scanned{0};
+
+int64_t NumSortedIdsScanned() { return num_sorted_ids_scanned; }
+
+// Remove all candidates, and put all examples at node in the right child.
+static void ClearCandidates(const TrainingNode& node,
+                            SplitCandidates* candidates) {
+  candidates->values.clear();
+  candidates->left_positive_weights.clear();
+  candidates->left_negative_weights.clear();
+  candidates->right_positive_weights.clear();
+  candidates->right_negative_weights.clear();
+  candidates->left_positive_weight = candidates->left_negative_weight = 0;
+  candidates->right_positive_weight = node.positive_weight;
+  candidates->right_negative_weight = node.negative_weight;
+}
+
+// Add the candidate with the given split value, which moves the given weights
+// from the right child to the left child of the previous candidate.
+static inline void AddCandidate(Value value, Weight positive_weight,
+                                Weight negative_weight,
+                                SplitCandidates* candidates) {
+  candidates->left_positive_weight += positive_weight;
+  candidates->right_positive_weight -= positive_weight;
+  candidates->left_negative_weight += negative_weight;
+  candidates->right_negative_weight -= negative_weight;
+  candidates->values.push_back(value);
+  candidates->left_positive_weights.push_back(
+      candidates->left_positive_weight);
+  candidates->left_negative_weights.push_back(
+      candidates->left_negative_weight);
+  candidates->right_positive_weights.push_back(
+      candidates->right_positive_weight);
+  candidates->right_negative_weights.push_back(
+      candidates->right_negative_weight);
+}
+
+#ifdef __AVX2__
+// fmin() of each lane of a and b: if one of them is NaN, the other one.
+// _mm256_min_ps() alone returns b whenever either one is NaN.
+static inline __m256 FMin(__m256 a, __m256 b) {
+  return _mm256_blendv_ps(_mm256_min_ps(a, b), a,
+                          _mm256_cmp_ps(b, b, _CMP_UNORD_Q));
+}
+#endif
+
+// Set delta_gradients[i] to the increase in the absolute gradient from making
+// candidate i, whose children's weights are given, where old_gradient is the
+// absolute gradient of the unsplit node. Computes the same values as
+// Gradient(new_error, tree_size, 0, -1), given that
+// complexity_penalty == ComplexityPenalty(tree_size).
+static void ScoreCandidates(const Weight* left_positive_weights,
+                            const Weight* left_negative_weights,
+                            const Weight* right_positive_weights,
+                            const Weight* right_negative_weights, int size,
+                            float complexity_penalty, float old_gradient,
+                            float* delta_gradients) {
+  int i = 0;
+#ifdef __AVX2__
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 half = _mm256_set1_ps(0.5);
+  const __m256 penalty = _mm256_set1_ps(complexity_penalty);
+  const __m256 old = _mm256_set1_ps(old_gradient);
+  for (; i + 8 <= size; i += 8) {
+    const __m256 new_error = _mm256_add_ps(
+        FMin(_mm256_loadu_ps(left_positive_weights + i),
+             _mm256_loadu_ps(left_negative_weights + i)),
+        FMin(_mm256_loadu_ps(right_positive_weights + i),
+             _mm256_loadu_ps(right_negative_weights + i)));
+    const __m256 edge = _mm256_sub_ps(new_error, half);
+    // The gradient is zero where |edge| <= complexity_penalty, and NaN where
+    // edge is NaN, as in the loop below.
+    const __m256 new_gradient = _mm256_and_ps(
+        _mm256_add_ps(edge, penalty),
+        _mm256_cmp_ps(_mm256_and_ps(edge, abs_mask), penalty, _CMP_NLE_UQ));
+    _mm256_storeu_ps(
+        delta_gradients + i,
+        _mm256_sub_ps(_mm256_and_ps(new_gradient, abs_mask), old));
+  }
+#endif
+  for (; i < size; ++i) {
+    const float new_error = fmin(left_positive_weights[i],
+                                 left_negative_weights[i]) +
+                            fmin(right_positive_weights[i],
+                                 right_negative_weights[i]);
+    const float edge = new_error - 0.5f;
+    const float new_gradient =
+        (fabs(edge) <= complexity_penalty) ? 0 : edge + complexity_penalty;
+    delta_gradients[i] = fabs(new_gradient) - old_gradient;
+  }
+}
+
+// Set split_value to the first candidate whose delta gradient exceeds that of
+// every earlier candidate by more than kTolerance, and delta_gradient to its
+// delta gradient, where the tree that node belongs to has tree_size nodes. If
+// no candidate increases the absolute gradient, delta_gradient is 0.
+static void ChooseSplit(const TreeContext& context, const TrainingNode& node,
+                        int tree_size, SplitCandidates* candidates,
+                        Value* split_value, float* delta_gradient) {
   *delta_gradient = 0;
-  Weight left_positive_weight = 0, left_negative_weight = 0,
-         right_positive_weight = node.positive_weight,
-         right_negative_weight = node.negative_weight;
-  float old_error = fmin(left_positive_weight + right_positive_weight,
-                         left_negative_weight + right_negative_weight);
-  float old_gradient = Gradient(old_error, tree_size, 0, -1);
+  float old_error = fmin(node.positive_weight, node.negative_weight);
+  float old_gradient = Gradient(context, old_error, tree_size, 0, -1);
+  const int size = candidates->values.size();
+  candidates->delta_gradients.resize(size);
+  float* delta_gradients = candidates->delta_gradients.data();
+  ScoreCandidates(candidates->left_positive_weights.data(),
+                  candidates->left_negative_weights.data(),
+                  candidates->right_positive_weights.data(),
+                  candidates->right_negative_weights.data(), size,
+                  ComplexityPenalty(context, tree_size + 2),
+                  fabs(old_gradient),
+                  delta_gradients);
+  int i = 0;
+#ifdef __AVX2__
+  // Skip blocks of candidates none of which beats the best one so far.
+  for (; i + 8 <= size; i += 8) {
+    const __m256 threshold = _mm256_set1_ps(*delta_gradient + kTolerance);
+    if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(delta_gradients + i),
+                                         threshold, _CMP_GT_OQ)) == 0) {
+      continue;
+    }
+    for (int j = i; j < i + 8; ++j) {
+      if (delta_gradients[j] > *delta_gradient + kTolerance) {
+        *delta_gradient = delta_gradients[j];
+        *split_value = candidates->values[j];
+      }
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    if (delta_gradients[i] > *delta_gradient + kTolerance) {
+      *delta_gradient = delta_gradients[i];
+      *split_value = candidates->values[i];
+    }
+  }
+}
+
+void BestSplitValue(const TreeContext& context,
+                    const map<Value, pair<Weight, Weight>>& value_to_weights,
+                    const TrainingNode& node, int tree_size,
+                    Value* split_value, float* delta_gradient) {
+  SplitCandidates* candidates = &thread_candidates;
+  ClearCandidates(node, candidates);
   for (const pair<Value, pair<Weight, Weight>>& elem : value_to_weights) {
-    left_positive_weight += elem.second.first;
-    right_positive_weight -= elem.second.first;
-    left_negative_weight += elem.second.second;
-    right_negative_weight -= elem.second.second;
-    float new_error = fmin(left_positive_weight, left_negative_weight) +
-                      fmin(right_positive_weight, right_negative_weight);
-    float new_gradient = Gradient(new_error, tree_size + 2, 0, -1);
-    if (fabs(new_gradient) - fabs(old_gradient) >
-        *delta_gradient + kTolerance) {
-      *delta_gradient = fabs(new_gradient) - fabs(old_gradient);
-      *split_value = elem.first;
+    AddCandidate(elem.first, elem.second.first, elem.second.second,
+                 candidates);
+  }
+  ChooseSplit(context, node, tree_size, candidates, split_value,
+              delta_gradient);
+}
+
+void BestSplitValueSorted(const TreeContext& context,
+                          const ColumnarDataset& data,
+                          const ColumnIndex& index, Feature feature,
+                          const ExamplePartition& partition, NodeId node_id,
+                          const TrainingNode& node, int tree_size,
+                          Value* split_value, float* delta_gradient) {
+  SplitCandidates* candidates = &thread_candidates;
+  ClearCandidates(node, candidates);
+  // Each run of equal values among the examples at node plays the role of one
+  // entry of the value-to-weights map in BestSplitValue(): its weights are
+  // summed first, and then moved from the right side to the left side at once.
+  bool in_run = false;
+  Value run_value = 0;
+  Weight run_positive_weight = 0, run_negative_weight = 0;
+  const Value* column = data.column(feature);
+  const bool node_sorted = !partition.sorted_ids.empty();
+  const ExampleId* sorted_ids = node_sorted
+                                    ? &partition.sorted_ids[feature][node.begin]
+                                    : index.sorted_ids[feature].data();
+  const int num_sorted_ids =
+      node_sorted ? node.end - node.begin : data.num_examples;
+  num_sorted_ids_scanned += num_sorted_ids;
+  for (int i = 0; i < num_sorted_ids; ++i) {
+    const ExampleId id = sorted_ids[i];
+    if (!node_sorted && partition.example_node[id] != node_id) continue;
+    const Value value = column[id];
+    if (!in_run || value != run_value) {
+      if (in_run) {
+        AddCandidate(run_value, run_positive_weight, run_negative_weight,
+                     candidates);
+      }
+      in_run = true;
+      run_value = value;
+      run_positive_weight = run_negative_weight = 0;
+    }
+    if (data.labels[id] == 1) {
+      run_positive_weight += data.weights[id];
+    } else {  // label == -1
+      run_negative_weight += data.weights[id];
+    }
+  }
+  if (in_run) {
+    AddCandidate(run_value, run_positive_weight, run_negative_weight,
+                 candidates);
+  }
+  ChooseSplit(context, node, tree_size, candidates, split_value,
+              delta_gradient);
+}
+
+void MakeHistogram(const TreeContext& context, const ColumnarDataset& data,
+                   const ColumnIndex& index, const vector<Feature>& features,
+                   const ExamplePartition& partition, const TrainingNode& node,
+                   Histogram* histogram) {
+  CHECK(!index.bins.empty());
+  histogram->assign(index.bin_offsets.back(), HistogramBin{0, 0, 0});
+  // Each thread fills the bins of its own block of features, adding the
+  // examples in the same order as a single thread would.
+  const int num_threads = context.params.num_threads;
+  const int num_blocks = std::min<int>(num_threads, features.size());
+  ParallelFor(0, num_blocks, num_threads, [&](int block) {
+    const int features_begin = features.size() * block / num_blocks;
+    const int features_end = features.size() * (block + 1) / num_blocks;
+    for (int i = node.begin; i < node.end; ++i) {
+      const ExampleId id = partition.example_ids[i];
+      const Weight weight = data.weights[id];
+      const uint8_t* bins =
+          &index.bins[static_cast<size_t>(id) * index.num_features];
+      if (data.labels[id] == 1) {
+        for (int j = features_begin; j < features_end; ++j) {
+          const Feature feature = features[j];
+          HistogramBin& bin =
+              (*histogram)[index.bin_offsets[feature] + bins[feature]];
+          bin.positive_weight += weight;
+          ++bin.num_examples;
+        }
+      } else {  // label == -1
+        for (int j = features_begin; j < features_end; ++j) {
+          const Feature feature = features[j];
+          HistogramBin& bin =
+              (*histogram)[index.bin_offsets[feature] + bins[feature]];
+          bin.negative_weight += weight;
+          ++bin.num_examples;
+        }
+      }
     }
+  });
+}
+
+void SubtractHistogram(const Histogram& child_histogram,
+                       Histogram* histogram) {
+  CHECK_EQ(child_histogram.size(), histogram->size());
+  for (size_t i = 0; i < histogram->size(); ++i) {
+    (*histogram)[i].positive_weight -= child_histogram[i].positive_weight;
+    (*histogram)[i].negative_weight -= child_histogram[i].negative_weight;
+    (*histogram)[i].num_examples -= child_histogram[i].num_examples;
+  }
+}
+
+void BestSplitValueHistogram(const TreeContext& context,
+                             const ColumnIndex& index, Feature feature,
+                             const Histogram& histogram,
+                             const TrainingNode& node, int tree_size,
+                             Value* split_value, float* delta_gradient) {
+  SplitCandidates* candidates = &thread_candidates;
+  ClearCandidates(node, candidates);
+  const vector<Value>& bin_values = index.bin_values[feature];
+  const HistogramBin* feature_bins = &histogram[index.bin_offsets[feature]];
+  for (size_t i = 0; i < bin_values.size(); ++i) {
+    const HistogramBin& bin = feature_bins[i];
+    // An empty bin is not a split value in the value-to-weights map.
+    if (bin.num_examples == 0) continue;
+    AddCandidate(bin_values[i], bin.positive_weight, bin.negative_weight,
+                 candidates);
   }
+  ChooseSplit(context, node, tree_size, candidates, split_value,
+              delta_gradient);
 }
 
-void MakeChildNodes(Feature split_feature, Value split_value, Node* parent,
-                    Tree* tree) {
+// Make the child nodes of parent_id as MakeChildNodes() does, sending the
+// examples for which goes_left(id) is true to the left child.
+template <class GoesLeft>
+static void SplitExamples(const ColumnarDataset& data, Feature split_feature,
+                          Value split_value, NodeId parent_id,
+                          const GoesLeft& goes_left,
+                          ExamplePartition* partition, TrainingTree* tree) {
+  TrainingNode* parent = &(*tree)[parent_id];
   parent->split_feature = split_feature;
   parent->split_value = split_value;
   parent->leaf = false;
-  Node left_child, right_child;
+  TrainingNode left_child, right_child;
   left_child.depth = right_child.depth = parent->depth + 1;
   left_child.leaf = right_child.leaf = true;
   left_child.positive_weight = left_child.negative_weight =
       right_child.positive_weight = right_child.negative_weight = 0;
-  for (const Example& example : parent->examples) {
-    Node* child;
-    if (example.values[split_feature] <= split_value) {
+  const NodeId left_child_id = tree->size();
+  const NodeId right_child_id = tree->size() + 1;
+  // Examples going left are compacted in place at the front of the parent's
+  // range, and examples going right are set aside and copied in after them.
+  vector<ExampleId>& example_ids = partition->example_ids;
+  int num_left = parent->begin, num_right = 0;
+  for (int i = parent->begin; i < parent->end; ++i) {
+    const ExampleId id = example_ids[i];
+    TrainingNode* child;
+    if (goes_left(id)) {
       child = &left_child;
+      example_ids[num_left++] = id;
+      partition->example_node[id] = left_child_id;
     } else {
       child = &right_child;
+      partition->scratch[num_right++] = id;
+      partition->example_node[id] = right_child_id;
     }
-    // TODO(usyed): Moving examples around is inefficient.
-    child->examples.push_back(example);
-    if (example.label == 1) {
-      child->positive_weight += example.weight;
+    if (data.labels[id] == 1) {
+      child->positive_weight += data.weights[id];
     } else {  // label == -1
-      child->negative_weight += example.weight;
+      child->negative_weight += data.weights[id];
     }
   }
-  parent->left_child_id = tree->size();
-  parent->right_child_id = tree->size() + 1;
+  std::copy(partition->scratch.begin(), partition->scratch.begin() + num_right,
+            example_ids.begin() + num_left);
+  left_child.begin = parent->begin;
+  left_child.end = right_child.begin = num_left;
+  right_child.end = parent->end;
+  parent->left_child_id = left_child_id;
+  parent->right_child_id = right_child_id;
   tree->push_back(left_child);
   tree->push_back(right_child);
 }
 
-Tree TrainTree(const vector<Example>& examples) {
-  CHECK(is_initialized);
-  Tree tree;
-  tree.push_back(MakeRootNode(examples));
+void MakeChildNodes(const ColumnarDataset& data, Feature split_feature,
+                    Value split_value, NodeId parent_id,
+                    ExamplePartition* partition, TrainingTree* tree) {
+  const Value* column = data.column(split_feature);
+  SplitExamples(data, split_feature, split_value, parent_id,
+                [column, split_value](ExampleId id) {
+                  return column[id] <= split_value;
+                },
+                partition, tree);
+}
+
+void MakeChildNodes(const ColumnarDataset& data, const ColumnIndex& index,
+                    Feature split_feature, Value split_value, NodeId parent_id,
+                    ExamplePartition* partition, TrainingTree* tree) {
+  if (index.bins.empty()) {
+    MakeChildNodes(data, split_feature, split_value, parent_id, partition,
+                   tree);
+    return;
+  }
+  // split_value is the largest value of one bin, so the examples with values
+  // <= split_value are exactly those in that bin or a lower one.
+  const vector<Value>& bin_values = index.bin_values[split_feature];
+  const int split_bin =
+      std::lower_bound(bin_values.begin(), bin_values.end(), split_value) -
+      bin_values.begin();
+  CHECK_LT(split_bin, static_cast<int>(bin_values.size()));
+  const uint8_t* bins = &index.bins[split_feature];
+  const size_t num_features = index.num_features;
+  SplitExamples(data, split_feature, split_value, parent_id,
+                [bins, num_features, split_bin](ExampleId id) {
+                  return bins[id * num_features] <= split_bin;
+                },
+                partition, tree);
+}
+
+void SortPartition(const ColumnIndex& index, ExamplePartition* partition) {
+  // Assigned feature by feature, so that a partition reused for the next tree
+  // keeps its arrays and only copies the ids into them.
+  partition->sorted_ids.resize(index.sorted_ids.size());
+  for (size_t feature = 0; feature < index.sorted_ids.size(); ++feature) {
+    partition->sorted_ids[feature].assign(index.sorted_ids[feature].begin(),
+                                          index.sorted_ids[feature].end());
+  }
+}
+
+// Used by SplitSortedIds(), one per thread.
+static thread_local vector<ExampleId> thread_right_ids;
+
+void SplitSortedIds(const TreeContext& context, const TrainingTree& tree,
+                    NodeId parent_id, ExamplePartition* partition) {
+  const TrainingNode& parent = tree[parent_id];
+  const NodeId left_child_id = parent.left_child_id;
+  const vector<NodeId>& example_node = partition->example_node;
+  ParallelFor(0, partition->sorted_ids.size(), context.params.num_threads,
+              [&](int feature) {
+    // As in MakeChildNodes(), examples going left are compacted in place and
+    // examples going right are copied in after them.
+    ExampleId* sorted_ids = partition->sorted_ids[feature].data();
+    vector<ExampleId>& right_ids = thread_right_ids;
+    right_ids.clear();
+    int num_left = parent.begin;
+    for (int i = parent.begin; i < parent.end; ++i) {
+      const ExampleId id = sorted_ids[i];
+      if (example_node[id] == left_child_id) {
+        sorted_ids[num_left++] = id;
+      } else {
+        right_ids.push_back(id);
+      }
+    }
+    std::copy(right_ids.begin(), right_ids.end(), sorted_ids + num_left);
+  });
+}
+
+Tree TrainTree(const TreeContext& context, const ColumnarDataset& data) {
+  ColumnIndex index;
+  MakeColumnIndex(context.params, data, &index);
+  return TrainTree(context, data, index);
+}
+
+Tree TrainTree(const TreeContext& context, const ColumnarDataset& data,
+               const ColumnIndex& index) {
+  return MakeTree(GrowTree(context, data, index));
+}
+
+Tree TrainTree(const TreeContext& context, const ColumnarDataset& data,
+               const ColumnIndex& index, ExamplePartition* partition) {
+  return MakeTree(GrowTree(context, data, index, partition));
+}
+
+Tree MakeTree(const TrainingTree& training_tree) {
+  Tree tree(training_tree.size());
+  for (size_t node_id = 0; node_id < training_tree.size(); ++node_id) {
+    const TrainingNode& training_node = training_tree[node_id];
+    Node& node = tree[node_id];
+    node.leaf = training_node.leaf;
+    if (node.leaf) {
+      node.split_feature = node.left_child_id = node.right_child_id = -1;
+      node.split_value = 0;
+    } else {
+      node.split_feature = training_node.split_feature;
+      node.split_value = training_node.split_value;
+      node.left_child_id = training_node.left_child_id;
+      node.right_child_id = training_node.right_child_id;
+    }
+    if (training_node.positive_weight >= training_node.negative_weight) {
+      node.label = 1;
+    } else {
+      node.label = -1;
+    }
+  }
+  return tree;
+}
+
+// Set features_to_consider to the features whose splits are considered at one
+// node.
+static void SampleFeatures(const TreeContext& context,
+                           vector<Feature>* features_to_consider) {
+  const int num_features = context.num_features;
+  const int max_features_per_split = context.params.max_features_per_split;
+  // 特征采样：对于高维数据，只考虑部分特征
+  if (max_features_per_split > 0 && 
+      max_features_per_split < num_features) {
+    // 随机选择特征子集
+    vector<Feature> all_features(num_features);
+    std::iota(all_features.begin(), all_features.end(), 0);
+    
+    // Per thread, so that models trained concurrently do not share it.
+    static thread_local std::random_device rd;
+    static thread_local std::mt19937 gen(rd());
+    std::shuffle(all_features.begin(), all_features.end(), gen);
+    
+    features_to_consider->assign(all_features.begin(), 
+                               all_features.begin() + max_features_per_split);
+  } else {
+    // 使用所有特征
+    features_to_consider->resize(num_features);
+    std::iota(features_to_consider->begin(), features_to_consider->end(),
+              0);
+  }
+}
+
+// Return the largest of the delta gradients of features_to_consider found by
+// the BestSplitValue*() functions, and set split_feature and split_value to
+// the split that achieves it. Ties go to the feature that comes first in
+// features_to_consider. Returns 0 if no split increases the gradient.
+static float ChooseFeature(const vector<Feature>& features_to_consider,
+                           const Value* split_values,
+                           const float* delta_gradients,
+                           Feature* split_feature, Value* split_value) {
+  float best_delta_gradient = 0;
+  for (size_t i = 0; i < features_to_consider.size(); ++i) {
+    if (delta_gradients[i] > best_delta_gradient + kTolerance) {
+      best_delta_gradient = delta_gradients[i];
+      *split_feature = features_to_consider[i];
+      *split_value = split_values[i];
+    }
+  }
+  return best_delta_gradient;
+}
+
+// The histograms of the nodes of a tree grown in histogram mode. The histogram
+// of a node is kept in a slot of histograms from when it is built until the
+// node has been split, and the slot is then reused.
+typedef struct HistogramPool {
+  vector<Histogram> histograms;
+  vector<int> free_slots;
+  vector<int> node_slot;  // -1 if a node has no histogram.
+} HistogramPool;
+
+// Return the histogram of node_id, building it for features first if the node
+// has none.
+static const Histogram& NodeHistogram(const TreeContext& context,
+                                      const ColumnarDataset& data,
+                                      const ColumnIndex& index,
+                                      const vector<Feature>& features,
+                                      const ExamplePartition& partition,
+                                      const TrainingTree& tree, NodeId node_id,
+                                      HistogramPool* pool) {
+  pool->node_slot.resize(tree.size(), -1);
+  int& slot = pool->node_slot[node_id];
+  if (slot < 0) {
+    if (pool->free_slots.empty()) {
+      slot = pool->histograms.size();
+      pool->histograms.emplace_back();
+    } else {
+      slot = pool->free_slots.back();
+      pool->free_slots.pop_back();
+    }
+    MakeHistogram(context, data, index, features, partition, tree[node_id],
+                  &pool->histograms[slot]);
+  }
+  return pool->histograms[slot];
+}
+
+// Release the histogram of node_id, if it has one.
+static void FreeHistogram(NodeId node_id, HistogramPool* pool) {
+  if (node_id >= static_cast<NodeId>(pool->node_slot.size())) return;
+  int& slot = pool->node_slot[node_id];
+  if (slot >= 0) pool->free_slots.push_back(slot);
+  slot = -1;
+}
+
+// Give both children of parent_id, which has just been split, their histograms
+// for features, the features of the parent's histogram: only the smaller
+// child's histogram is built, and the larger child takes over the parent's
+// slot, from which the smaller child's histogram is subtracted.
+static void SplitHistograms(const TreeContext& context,
+                            const ColumnarDataset& data,
+                            const ColumnIndex& index,
+                            const vector<Feature>& features,
+                            const ExamplePartition& partition,
+                            const TrainingTree& tree, NodeId parent_id,
+                            HistogramPool* pool) {
+  NodeId smaller_child_id = tree[parent_id].left_child_id;
+  NodeId larger_child_id = tree[parent_id].right_child_id;
+  if (tree[smaller_child_id].end - tree[smaller_child_id].begin >
+      tree[larger_child_id].end - tree[larger_child_id].begin) {
+    std::swap(smaller_child_id, larger_child_id);
+  }
+  const Histogram& smaller_histogram =
+      NodeHistogram(context, data, index, features, partition, tree,
+                    smaller_child_id, pool);
+  int& parent_slot = pool->node_slot[parent_id];
+  SubtractHistogram(smaller_histogram, &pool->histograms[parent_slot]);
+  pool->node_slot[larger_child_id] = parent_slot;
+  parent_slot = -1;
+}
+
+// Grow a tree by splitting one node at a time, in breadth-first order.
+static TrainingTree GrowTreeBreadthFirst(const TreeContext& context,
+                                         const ColumnarDataset& data,
+                                         const ColumnIndex& index,
+                                         ExamplePartition* partition) {
+  const TreeParams& params = context.params;
+  const bool use_histogram = (params.split_mode == "histogram");
+  TrainingTree tree;
+  tree.push_back(MakeRootNode(data, partition));
+  if (!use_histogram && params.tree_depth > 0) {
+    SortPartition(index, partition);
+  } else {
+    partition->sorted_ids.clear();
+  }
+  // In histogram mode, if every feature is considered at every node, only the
+  // smaller child of a split has its histogram built, and the larger child's
+  // is derived from the parent's.
+  const bool subtract_histograms =
+      use_histogram && (params.max_features_per_split <= 0 ||
+                        params.max_features_per_split >= data.num_features);
+  HistogramPool histogram_pool;
+  vector<Feature> features_to_consider;
+  vector<Value> split_values;
+  vector<float> delta_gradients;
   NodeId node_id = 0;
   while (node_id < tree.size()) {
-    Node& node = tree[node_id];  // TODO(usyed): Too bad this can't be const.
+    const TrainingNode& node = tree[node_id];
+    // Nodes at the maximum depth are never split.
+    if (node.depth >= params.tree_depth) {
+      ++node_id;
+      continue;
+    }
+    SampleFeatures(context, &features_to_consider);
+    const Histogram* histogram =
+        use_histogram
+            ? &NodeHistogram(context, data, index, features_to_consider,
+                             *partition, tree, node_id, &histogram_pool)
+            : nullptr;
+    // The features are searched concurrently, and their results are then
+    // compared in the order of features_to_consider, so that ties go to the
+    // same feature whatever the number of threads.
+    split_values.resize(features_to_consider.size());
+    delta_gradients.resize(features_to_consider.size());
+    ParallelFor(0, features_to_consider.size(), params.num_threads,
+                [&](int i) {
+      if (use_histogram) {
+        BestSplitValueHistogram(context, index, features_to_consider[i],
+                                *histogram, node, tree.size(),
+                                &split_values[i], &delta_gradients[i]);
+      } else {
+        BestSplitValueSorted(context, data, index, features_to_consider[i],
+                             *partition, node_id, node, tree.size(),
+                             &split_values[i], &delta_gradients[i]);
+      }
+    });
     Feature best_split_feature;
     Value best_split_value;
-    float best_delta_gradient = 0;
-    
-    // 特征采样：对于高维数据，只考虑部分特征
-    vector<Feature> features_to_consider;
-    if (FLAGS_max_features_per_split > 0 && 
-        FLAGS_max_features_per_split < num_features) {
-      // 随机选择特征子集
-      vector<Feature> all_features(num_features);
-      std::iota(all_features.begin(), all_features.end(), 0);
-      
-      static std::random_device rd;
-      static std::mt19937 gen(rd());
-      std::shuffle(all_features.begin(), all_features.end(), gen);
-      
-      features_to_consider.assign(all_features.begin(), 
-                                 all_features.begin() + FLAGS_max_features_per_split);
-    } else {
-      // 使用所有特征
-      features_to_consider.resize(num_features);
-      std::iota(features_to_consider.begin(), features_to_consider.end(), 0);
+    if (ChooseFeature(features_to_consider, split_values.data(),
+                      delta_gradients.data(), &best_split_feature,
+                      &best_split_value) > kTolerance) {
+      MakeChildNodes(data, index, best_split_feature, best_split_value,
+                     node_id, partition, &tree);
+      if (!use_histogram && tree[node_id].depth + 1 < params.tree_depth) {
+        SplitSortedIds(context, tree, node_id, partition);
+      }
+      if (subtract_histograms && tree[node_id].depth + 1 < params.tree_depth) {
+        SplitHistograms(context, data, index, features_to_consider, *partition,
+                        tree, node_id, &histogram_pool);
+      }
     }
-    
-    // 在选定的特征中寻找最佳分裂
-    for (Feature split_feature : features_to_consider) {
-      const map<Value, pair<Weight, Weight>> value_to_weights =
-          MakeValueToWeightsMap(node, split_feature);
-      Value split_value;
-      float delta_gradient;
-      BestSplitValue(value_to_weights, node, tree.size(), &split_value,
-                     &delta_gradient);
-      if (delta_gradient > best_delta_gradient + kTolerance) {
-        best_delta_gradient = delta_gradient;
-        best_split_feature = split_feature;
-        best_split_value = split_value;
+    FreeHistogram(node_id, &histogram_pool);
+    ++node_id;
+  }
+  return tree;
+}
+
+// The state of the scan of one feature's sorted values at one node of a level
+// in ScanLevelSorted().
+typedef struct NodeScan {
+  SplitCandidates* candidates;
+  bool in_run;
+  Value run_value;
+  Weight run_positive_weight, run_negative_weight;
+} NodeScan;
+
+static thread_local vector<NodeScan> thread_node_scans;
+
+// Same as calling BestSplitValueSorted() for feature at each node of the
+// level, i.e., nodes level_begin to tree.size() - 1, but with a single pass
+// over the examples. Node level_begin + i is scored as if the tree had
+// tree.size() + 2 * i nodes, which is its size when the node is reached if
+// every earlier node of the level is split. Its results are stored in entry
+// i * data.num_features + feature of split_values and delta_gradients, and its
+// candidates in the same entry of candidates, so that the node can be scored
+// again for another tree size without another pass.
+static void ScanLevelSorted(const TreeContext& context,
+                            const ColumnarDataset& data,
+                            const ColumnIndex& index, Feature feature,
+                            const ExamplePartition& partition,
+                            const TrainingTree& tree, NodeId level_begin,
+                            Value* split_values, float* delta_gradients,
+                            SplitCandidates* candidates) {
+  const int level_size = tree.size() - level_begin;
+  vector<NodeScan>& scans = thread_node_scans;
+  if (static_cast<int>(scans.size()) < level_size) scans.resize(level_size);
+  for (int i = 0; i < level_size; ++i) {
+    scans[i].candidates = &candidates[i * data.num_features + feature];
+    ClearCandidates(tree[level_begin + i], scans[i].candidates);
+    scans[i].in_run = false;
+  }
+  num_sorted_ids_scanned += index.sorted_ids[feature].size();
+  const Value* column = data.column(feature);
+  for (ExampleId id : index.sorted_ids[feature]) {
+    // Examples at leaves of earlier levels have smaller node ids.
+    const int i = partition.example_node[id] - level_begin;
+    if (i < 0) continue;
+    NodeScan& scan = scans[i];
+    const Value value = column[id];
+    if (!scan.in_run || value != scan.run_value) {
+      if (scan.in_run) {
+        AddCandidate(scan.run_value, scan.run_positive_weight,
+                     scan.run_negative_weight, scan.candidates);
+      }
+      scan.in_run = true;
+      scan.run_value = value;
+      scan.run_positive_weight = scan.run_negative_weight = 0;
+    }
+    if (data.labels[id] == 1) {
+      scan.run_positive_weight += data.weights[id];
+    } else {  // label == -1
+      scan.run_negative_weight += data.weights[id];
+    }
+  }
+  for (int i = 0; i < level_size; ++i) {
+    NodeScan& scan = scans[i];
+    if (scan.in_run) {
+      AddCandidate(scan.run_value, scan.run_positive_weight,
+                   scan.run_negative_weight, scan.candidates);
+    }
+    const int entry = i * data.num_features + feature;
+    ChooseSplit(context, tree[level_begin + i], tree.size() + 2 * i,
+                scan.candidates, &split_values[entry],
+                &delta_gradients[entry]);
+  }
+}
+
+// Same as calling MakeHistogram() for each node i of the level, i.e., node
+// level_begin + i, for which build[i] is true, with features[i] and
+// histograms[i], but with a single pass over the examples.
+static void MakeLevelHistograms(const TreeContext& context,
+                                const ColumnarDataset& data,
+                                const ColumnIndex& index,
+                                const vector<vector<Feature>>& features,
+                                const ExamplePartition& partition,
+                                NodeId level_begin, const vector<bool>& build,
+                                vector<Histogram>* histograms) {
+  const int level_size = features.size();
+  for (int i = 0; i < level_size; ++i) {
+    if (build[i]) {
+      (*histograms)[i].assign(index.bin_offsets.back(),
+                              HistogramBin{0, 0, 0});
+    }
+  }
+  // As in MakeHistogram(), each thread fills the bins of its own block of
+  // every node's features. The examples of a node are kept in increasing
+  // order of id by MakeChildNodes(), so every bin adds up the same weights in
+  // the same order as MakeHistogram() does.
+  const int num_blocks = context.params.num_threads;
+  ParallelFor(0, num_blocks, num_blocks, [&](int block) {
+    for (ExampleId id = 0; id < data.num_examples; ++id) {
+      const int i = partition.example_node[id] - level_begin;
+      if (i < 0 || !build[i]) continue;
+      const vector<Feature>& node_features = features[i];
+      const int features_begin = node_features.size() * block / num_blocks;
+      const int features_end = node_features.size() * (block + 1) / num_blocks;
+      const Weight weight = data.weights[id];
+      const uint8_t* bins =
+          &index.bins[static_cast<size_t>(id) * index.num_features];
+      Histogram& histogram = (*histograms)[i];
+      if (data.labels[id] == 1) {
+        for (int j = features_begin; j < features_end; ++j) {
+          const Feature feature = node_features[j];
+          HistogramBin& bin =
+              histogram[index.bin_offsets[feature] + bins[feature]];
+          bin.positive_weight += weight;
+          ++bin.num_examples;
+        }
+      } else {  // label == -1
+        for (int j = features_begin; j < features_end; ++j) {
+          const Feature feature = node_features[j];
+          HistogramBin& bin =
+              histogram[index.bin_offsets[feature] + bins[feature]];
+          bin.negative_weight += weight;
+          ++bin.num_examples;
+        }
       }
     }
+  });
+}
 
+// Grow the same tree as GrowTreeBreadthFirst(), but one level at a time: the
+// statistics of all nodes at one depth are gathered with one pass over the
+// data (per feature in exact mode), using the node of each example kept in
+// the partition, and the nodes are then split in breadth-first order.
+static TrainingTree GrowTreeLevelWise(const TreeContext& context,
+                                      const ColumnarDataset& data,
+                                      const ColumnIndex& index,
+                                      ExamplePartition* partition) {
+  const TreeParams& params = context.params;
+  const bool use_histogram = (params.split_mode == "histogram");
+  const bool subtract_histograms =
+      use_histogram && (params.max_features_per_split <= 0 ||
+                        params.max_features_per_split >= data.num_features);
+  TrainingTree tree;
+  tree.push_back(MakeRootNode(data, partition));
+  // Each level is scanned in the order of the column index instead.
+  partition->sorted_ids.clear();
+  vector<vector<Feature>> level_features;
+  vector<bool> build;
+  // The histograms of the nodes of the current and the previous level.
+  vector<Histogram> histograms, parent_histograms;
+  // The results of every feature at every node of the level, and in exact
+  // mode its candidates. The candidates of earlier levels are overwritten, so
+  // that their arrays are reused.
+  vector<Value> split_values;
+  vector<float> delta_gradients;
+  vector<SplitCandidates> candidates;
+  vector<Value> ordered_split_values;
+  vector<float> ordered_delta_gradients;
+  NodeId parent_level_begin = 0, level_begin = 0;
+  while (level_begin < static_cast<NodeId>(tree.size()) &&
+         tree[level_begin].depth < params.tree_depth) {
+    const NodeId level_end = tree.size();
+    const int level_size = level_end - level_begin;
+    // Features are sampled for the nodes in the same order as in
+    // GrowTreeBreadthFirst().
+    level_features.resize(level_size);
+    for (int i = 0; i < level_size; ++i) {
+      SampleFeatures(context, &level_features[i]);
+    }
+    split_values.resize(level_size * data.num_features);
+    delta_gradients.resize(level_size * data.num_features);
+    if (use_histogram) {
+      std::swap(histograms, parent_histograms);
+      if (static_cast<int>(histograms.size()) < level_size) {
+        histograms.resize(level_size);
+      }
+      build.assign(level_size, true);
+      // Of two children, the histogram of only the smaller one is built, as
+      // in GrowTreeBreadthFirst().
+      if (subtract_histograms && level_begin > 0) {
+        for (NodeId parent_id = parent_level_begin; parent_id < level_begin;
+             ++parent_id) {
+          const TrainingNode& parent = tree[parent_id];
+          if (parent.leaf) continue;
+          NodeId smaller_child_id = parent.left_child_id;
+          NodeId larger_child_id = parent.right_child_id;
+          if (tree[smaller_child_id].end - tree[smaller_child_id].begin >
+              tree[larger_child_id].end - tree[larger_child_id].begin) {
+            std::swap(smaller_child_id, larger_child_id);
+          }
+          build[larger_child_id - level_begin] = false;
+        }
+      }
+      MakeLevelHistograms(context, data, index, level_features, *partition,
+                          level_begin, build, &histograms);
+      if (subtract_histograms && level_begin > 0) {
+        for (NodeId parent_id = parent_level_begin; parent_id < level_begin;
+             ++parent_id) {
+          const TrainingNode& parent = tree[parent_id];
+          if (parent.leaf) continue;
+          const int left = parent.left_child_id - level_begin;
+          const int right = parent.right_child_id - level_begin;
+          const int larger = build[left] ? right : left;
+          const int smaller = build[left] ? left : right;
+          histograms[larger] =
+              parent_histograms[parent_id - parent_level_begin];
+          SubtractHistogram(histograms[smaller], &histograms[larger]);
+        }
+      }
+    } else {
+      const size_t num_entries =
+          static_cast<size_t>(level_size) * data.num_features;
+      if (candidates.size() < num_entries) candidates.resize(num_entries);
+      vector<bool> feature_used(data.num_features, false);
+      for (const vector<Feature>& features : level_features) {
+        for (Feature feature : features) feature_used[feature] = true;
+      }
+      ParallelFor(0, data.num_features, params.num_threads, [&](int feature) {
+        if (!feature_used[feature]) return;
+        ScanLevelSorted(context, data, index, feature, *partition, tree,
+                        level_begin, split_values.data(),
+                        delta_gradients.data(), candidates.data());
+      });
+    }
+    // Split the nodes in breadth-first order. The splits of a node depend on
+    // the size of the tree when it is reached, so they are scored again unless
+    // the size is the one ScanLevelSorted() assumed. In exact mode the
+    // candidates it kept are scored again, without another pass over the data.
+    for (int i = 0; i < level_size; ++i) {
+      const NodeId node_id = level_begin + i;
+      const vector<Feature>& features = level_features[i];
+      Value* node_split_values = &split_values[i * data.num_features];
+      float* node_delta_gradients = &delta_gradients[i * data.num_features];
+      if (use_histogram ||
+          static_cast<NodeId>(tree.size()) != level_end + 2 * i) {
+        ParallelFor(0, features.size(), params.num_threads, [&](int j) {
+          const Feature feature = features[j];
+          if (use_histogram) {
+            BestSplitValueHistogram(context, index, feature, histograms[i],
+                                    tree[node_id], tree.size(),
+                                    &node_split_values[feature],
+                                    &node_delta_gradients[feature]);
+          } else {
+            ChooseSplit(context, tree[node_id], tree.size(),
+                        &candidates[i * data.num_features + feature],
+                        &node_split_values[feature],
+                        &node_delta_gradients[feature]);
+          }
+        });
+      }
+      // ChooseFeature() expects the results in the order of features.
+      ordered_split_values.resize(features.size());
+      ordered_delta_gradients.resize(features.size());
+      for (size_t j = 0; j < features.size(); ++j) {
+        ordered_split_values[j] = node_split_values[features[j]];
+        ordered_delta_gradients[j] = node_delta_gradients[features[j]];
+      }
+      Feature best_split_feature;
+      Value best_split_value;
+      if (ChooseFeature(features, ordered_split_values.data(),
+                        ordered_delta_gradients.data(), &best_split_feature,
+                        &best_split_value) > kTolerance) {
+        MakeChildNodes(data, index, best_split_feature, best_split_value,
+                       node_id, partition, &tree);
+      }
+    }
+    parent_level_begin = level_begin;
+    level_begin = level_end;
+  }
+  return tree;
+}
 
-    if (node.depth < FLAGS_tree_depth && best_delta_gradient > kTolerance) {
-      MakeChildNodes(best_split_feature, best_split_value, &node, &tree);
+// Grow a tree by always splitting the node whose best split increases the
+// gradient the most, until the tree has max_leaves leaves or no split helps.
+// The gain of a split depends on the size of the tree, so the gain of a node
+// is brought up to date when it reaches the front of the queue, and the node
+// is put back if its gain was out of date.
+static TrainingTree GrowTreeBestFirst(const TreeContext& context,
+                                      const ColumnarDataset& data,
+                                      const ColumnIndex& index,
+                                      ExamplePartition* partition) {
+  const TreeParams& params = context.params;
+  const bool use_histogram = (params.split_mode == "histogram");
+  const bool subtract_histograms =
+      use_histogram && (params.max_features_per_split <= 0 ||
+                        params.max_features_per_split >= data.num_features);
+  TrainingTree tree;
+  tree.push_back(MakeRootNode(data, partition));
+  if (!use_histogram && params.tree_depth > 0) {
+    SortPartition(index, partition);
+  } else {
+    partition->sorted_ids.clear();
+  }
+  HistogramPool histogram_pool;
+  // The best split of each node waiting to be split, and the size of the tree
+  // it was found for.
+  vector<vector<Feature>> node_features(1);
+  vector<Feature> node_split_feature(1);
+  vector<Value> node_split_value(1);
+  vector<float> node_delta_gradient(1);
+  vector<int> node_tree_size(1);
+  vector<Value> split_values;
+  vector<float> delta_gradients;
+  auto find_split = [&](NodeId node_id) {
+    const vector<Feature>& features = node_features[node_id];
+    const Histogram* histogram =
+        use_histogram ? &NodeHistogram(context, data, index, features,
+                                       *partition, tree, node_id,
+                                       &histogram_pool)
+                      : nullptr;
+    split_values.resize(features.size());
+    delta_gradients.resize(features.size());
+    ParallelFor(0, features.size(), params.num_threads, [&](int i) {
+      if (use_histogram) {
+        BestSplitValueHistogram(context, index, features[i], *histogram,
+                                tree[node_id], tree.size(), &split_values[i],
+                                &delta_gradients[i]);
+      } else {
+        BestSplitValueSorted(context, data, index, features[i], *partition,
+                             node_id, tree[node_id], tree.size(),
+                             &split_values[i], &delta_gradients[i]);
+      }
+    });
+    node_delta_gradient[node_id] = ChooseFeature(
+        features, split_values.data(), delta_gradients.data(),
+        &node_split_feature[node_id], &node_split_value[node_id]);
+    node_tree_size[node_id] = tree.size();
+  };
+  // Larger gains first, and ties to the node created first.
+  auto compare = [&](NodeId a, NodeId b) {
+    if (node_delta_gradient[a] != node_delta_gradient[b]) {
+      return node_delta_gradient[a] < node_delta_gradient[b];
     }
-    ++node_id;
+    return a > b;
+  };
+  std::priority_queue<NodeId, vector<NodeId>, decltype(compare)> queue(
+      compare);
+  if (params.tree_depth > 0) {
+    SampleFeatures(context, &node_features[0]);
+    find_split(0);
+    queue.push(0);
+  }
+  int num_leaves = 1;
+  while (!queue.empty() && num_leaves < params.max_leaves) {
+    const NodeId node_id = queue.top();
+    queue.pop();
+    if (node_tree_size[node_id] != static_cast<int>(tree.size())) {
+      find_split(node_id);
+      queue.push(node_id);
+      continue;
+    }
+    if (node_delta_gradient[node_id] <= kTolerance) {
+      FreeHistogram(node_id, &histogram_pool);
+      continue;
+    }
+    MakeChildNodes(data, index, node_split_feature[node_id],
+                   node_split_value[node_id], node_id, partition, &tree);
+    ++num_leaves;
+    node_features.resize(tree.size());
+    node_split_feature.resize(tree.size());
+    node_split_value.resize(tree.size());
+    node_delta_gradient.resize(tree.size());
+    node_tree_size.resize(tree.size());
+    const NodeId left_child_id = tree[node_id].left_child_id;
+    const NodeId right_child_id = tree[node_id].right_child_id;
+    if (tree[left_child_id].depth < params.tree_depth) {
+      if (!use_histogram) {
+        SplitSortedIds(context, tree, node_id, partition);
+      }
+      if (subtract_histograms) {
+        SplitHistograms(context, data, index, node_features[node_id],
+                        *partition, tree, node_id, &histogram_pool);
+      }
+      for (NodeId child_id : {left_child_id, right_child_id}) {
+        SampleFeatures(context, &node_features[child_id]);
+        find_split(child_id);
+        queue.push(child_id);
+      }
+    }
+    FreeHistogram(node_id, &histogram_pool);
   }
   return tree;
 }
 
+TrainingTree GrowTree(const TreeContext& context, const ColumnarDataset& data,
+                      const ColumnIndex& index) {
+  ExamplePartition partition;
+  return GrowTree(context, data, index, &partition);
+}
+
+TrainingTree GrowTree(const TreeContext& context, const ColumnarDataset& data,
+                      const ColumnIndex& index, ExamplePartition* partition) {
+  CHECK_EQ(data.num_examples, context.num_examples);
+  CHECK_EQ(data.num_features, context.num_features);
+  if (context.params.split_mode == "histogram") {
+    CHECK_EQ(static_cast<int>(index.bin_values.size()), data.num_features);
+  } else {
+    CHECK_EQ(static_cast<int>(index.sorted_ids.size()), data.num_features);
+    CHECK(data.values != nullptr);
+  }
+  if (context.params.growth == "level_wise") {
+    return GrowTreeLevelWise(context, data, index, partition);
+  } else if (context.params.growth == "best_first") {
+    return GrowTreeBestFirst(context, data, index, partition);
+  }
+  return GrowTreeBreadthFirst(context, data, index, partition);
+}
+
+void PackTree(const Tree& tree, vector<PackedNode>* nodes) {
+  CHECK_GE(tree.size(), 1);
+  const int root = nodes->size();
+  nodes->resize(root + tree.size());
+  // order[i] is the node of tree that goes to position i after root.
+  vector<NodeId> order(1, 0);
+  order.reserve(tree.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    const Node& node = tree[order[i]];
+    PackedNode& packed_node = (*nodes)[root + i];
+    if (node.leaf) {
+      packed_node.split_feature = -1;
+      packed_node.split_value = node.label;
+      packed_node.left_child_id = -1;
+    } else {
+      packed_node.split_feature = node.split_feature;
+      packed_node.split_value = node.split_value;
+      packed_node.left_child_id = order.size();
+      order.push_back(node.left_child_id);
+      order.push_back(node.right_child_id);
+    }
+  }
+  CHECK_EQ(order.size(), tree.size());
+}
+
+Label ClassifyExample(const Example& example, const PackedNode* root) {
+  return ClassifyExample(example.values.data(), root);
+}
+
+Label ClassifyExample(const Value* values, const PackedNode* root) {
+  const PackedNode* node = root;
+  while (node->split_feature >= 0) {
+    // The right child follows the left one. Written as !(x <= t), so that a
+    // NaN value goes right, as in ClassifyExample() on a Tree.
+    node = root + node->left_child_id +
+           !(values[node->split_feature] <= node->split_value);
+  }
+  return static_cast<Label>(node->split_value);
+}
+
+int TreeDepth(const Tree& tree) {
+  // Children come after their parent.
+  vector<int> depths(tree.size(), 0);
+  int max_depth = 0;
+  for (size_t node_id = 0; node_id < tree.size(); ++node_id) {
+    const Node& node = tree[node_id];
+    max_depth = std::max(max_depth, depths[node_id]);
+    if (node.leaf) continue;
+    depths[node.left_child_id] = depths[node.right_child_id] =
+        depths[node_id] + 1;
+  }
+  return max_depth;
+}
+
+// Lay out the subtree of tree under node_id at slot of a tree of heap_model
+// that starts at split_features, split_values and leaf_labels.
+static void FillHeapSlots(const Tree& tree, NodeId node_id, int slot,
+                          int depth, int max_depth, Feature* split_features,
+                          Value* split_values, Value* leaf_labels) {
+  const Node& node = tree[node_id];
+  if (depth == max_depth) {
+    CHECK(node.leaf);
+    leaf_labels[slot - ((1 << max_depth) - 1)] = node.label;
+    return;
+  }
+  NodeId left_child_id, right_child_id;
+  if (node.leaf) {
+    // Padding: every example goes left, and ends up at a copy of the leaf.
+    split_features[slot] = 0;
+    split_values[slot] = std::numeric_limits<Value>::infinity();
+    left_child_id = right_child_id = node_id;
+  } else {
+    split_features[slot] = node.split_feature;
+    split_values[slot] = node.split_value;
+    left_child_id = node.left_child_id;
+    right_child_id = node.right_child_id;
+  }
+  FillHeapSlots(tree, left_child_id, 2 * slot + 1, depth + 1, max_depth,
+                split_features, split_values, leaf_labels);
+  FillHeapSlots(tree, right_child_id, 2 * slot + 2, depth + 1, max_depth,
+                split_features, split_values, leaf_labels);
+}
+
+void AppendHeapTree(const Tree& tree, Weight weight, HeapModel* heap_model) {
+  const int depth = heap_model->depth;
+  CHECK_LE(depth, kMaxHeapTreeDepth);
+  CHECK_LE(TreeDepth(tree), depth);
+  const int num_splits = (1 << depth) - 1, num_leaves = 1 << depth;
+  const int tree_id = heap_model->weights.size();
+  heap_model->weights.push_back(weight);
+  heap_model->split_features.resize((tree_id + 1) * num_splits);
+  heap_model->split_values.resize((tree_id + 1) * num_splits);
+  heap_model->leaf_labels.resize((tree_id + 1) * num_leaves);
+  FillHeapSlots(tree, 0, 0, 0, depth,
+                heap_model->split_features.data() + tree_id * num_splits,
+                heap_model->split_values.data() + tree_id * num_splits,
+                heap_model->leaf_labels.data() + tree_id * num_leaves);
+}
+
 Label ClassifyExample(const Example& example, const Tree& tree) {
   CHECK_GE(tree.size(), 1);
   const Node* node = &tree[0];
@@ -198,16 +1396,27 @@ Label ClassifyExample(const Example& example, const Tree& tree) {
       node = &tree[node->right_child_id];
     }
   }
-  if (node->positive_weight >= node->negative_weight) {
-    return 1;
-  } else {
-    return -1;
+  return node->label;
+}
+
+Label ClassifyExample(const ColumnarDataset& data, ExampleId id,
+                      const Tree& tree) {
+  CHECK_GE(tree.size(), 1);
+  const Node* node = &tree[0];
+  while (node->leaf == false) {
+    if (data.value(id, node->split_feature) <= node->split_value) {
+      node = &tree[node->left_child_id];
+    } else {
+      node = &tree[node->right_child_id];
+    }
   }
+  return node->label;
 }
 
-float Gradient(float wgtd_error, int tree_size, float alpha, int sign_edge) {
+float Gradient(const TreeContext& context, float wgtd_error, int tree_size,
+               float alpha, int sign_edge) {
     // TODO(usyed): Can we make some mild assumptions and get rid of sign_edge?
-  const float complexity_penalty = ComplexityPenalty(tree_size);
+  const float complexity_penalty = ComplexityPenalty(context, tree_size);
   const float edge = wgtd_error - 0.5;
   const int sign_alpha = (alpha >= 0) ? 1 : -1;
 /*
@@ -229,22 +1438,61 @@ float Gradient(float wgtd_error, int tree_size, float alpha, int sign_edge) {
   }
 }
 
-float EvaluateTreeWgtd(const vector<Example>& examples, const Tree& tree) {
+float EvaluateTreeWgtd(const ColumnarDataset& data, const Tree& tree) {
+  float wgtd_error = 0;
+  for (ExampleId id = 0; id < data.num_examples; ++id) {
+    if (ClassifyExample(data, id, tree) != data.labels[id]) {
+      wgtd_error += data.weights[id];
+    }
+  }
+  return wgtd_error;
+}
+
+void MakeIncorrectSet(const ColumnarDataset& data, const Tree& tree,
+                      ExampleSet* incorrect) {
+  incorrect->assign((data.num_examples + 63) / 64, 0);
+  for (ExampleId id = 0; id < data.num_examples; ++id) {
+    if (ClassifyExample(data, id, tree) != data.labels[id]) {
+      (*incorrect)[id / 64] |= uint64_t{1} << (id % 64);
+    }
+  }
+}
+
+void MakeIncorrectSet(const ColumnarDataset& data, const Tree& tree,
+                      const ExamplePartition& partition,
+                      ExampleSet* incorrect) {
+  CHECK_EQ(static_cast<int>(partition.example_node.size()), data.num_examples);
+  incorrect->assign((data.num_examples + 63) / 64, 0);
+  for (ExampleId id = 0; id < data.num_examples; ++id) {
+    if (tree[partition.example_node[id]].label != data.labels[id]) {
+      (*incorrect)[id / 64] |= uint64_t{1} << (id % 64);
+    }
+  }
+}
+
+float EvaluateTreeWgtd(const ExampleSet& incorrect,
+                       const vector<Weight>& weights) {
+  // The weights are added in increasing order of id, as in the other
+  // EvaluateTreeWgtd(), so that both return exactly the same error.
   float wgtd_error = 0;
-  for (const Example& example : examples) {
-    if (ClassifyExample(example, tree) != example.label) {
-      wgtd_error += example.weight;
+  for (size_t word = 0; word < incorrect.size(); ++word) {
+    for (uint64_t bits = incorrect[word]; bits != 0; bits &= bits - 1) {
+      wgtd_error += weights[word * 64 + __builtin_ctzll(bits)];
     }
   }
   return wgtd_error;
 }
 
-float ComplexityPenalty(int tree_size) {
-  CHECK(is_initialized);
+float ComplexityPenalty(const TreeContext& context, int tree_size) {
+  const vector<float>& rademacher_complexities =
+      context.rademacher_complexities;
+  CHECK(!rademacher_complexities.empty());
   float rademacher =
-      sqrt(((2 * tree_size + 1) * (log(num_features + 2) / log(2)) *
-            log(num_examples)) /
-           num_examples);
-  return ((FLAGS_lambda * rademacher + FLAGS_beta) * num_examples) /
-         (2 * the_normalizer);
+      (tree_size < static_cast<int>(rademacher_complexities.size()))
+          ? rademacher_complexities[tree_size]
+          : RademacherComplexity(context, tree_size);
+  // Computed in double, since beta and lambda are.
+  return ((context.params.lambda * rademacher + context.params.beta) *
+          context.num_examples) /
+         (2 * context.normalizer);
 }
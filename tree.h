@@ -19,36 +19,197 @@
 
 #include "types.h"
 
-// Initialize some global variables.
-void InitializeTreeData(const vector<Example>& examples, float normalizer);
-
-// Return root node for a tree.
-Node MakeRootNode(const vector<Example>& examples);
-
-// Return a tree trained on examples.
-Tree TrainTree(const vector<Example>& examples);
+// The hyperparameters of growing trees. See the flags of the same names.
+typedef struct TreeParams {
+  double beta;
+  double lambda;
+  int tree_depth;
+  int max_features_per_split;
+  string split_mode;
+  int max_bins;
+  string growth;
+  int max_leaves;
+  int num_threads;
+} TreeParams;
+
+// Return the tree params given by the flags.
+TreeParams TreeParamsFromFlags();
+
+// What growing and scoring trees needs to know besides the training data. Each
+// model being trained has its own, so that models can be trained concurrently.
+typedef struct TreeContext {
+  TreeParams params;
+  int num_examples;
+  int num_features;
+  // The normalizer of the example weights. See ComplexityPenalty().
+  float normalizer;
+  // rademacher_complexities[tree_size] is the Rademacher complexity term of
+  // ComplexityPenalty() for trees of tree_size nodes, for every tree size that
+  // a tree can reach while it is grown with params.
+  vector<float> rademacher_complexities;
+} TreeContext;
+
+// Set up context for growing trees with params on data.
+void InitializeTreeContext(const TreeParams& params,
+                           const ColumnarDataset& data, float normalizer,
+                           TreeContext* context);
+
+// Store examples column by column in data.
+void MakeColumnarDataset(const vector<Example>& examples,
+                         ColumnarDataset* data);
+
+// Build the column index of data. Which parts of the index are filled in
+// depends on params.split_mode.
+void MakeColumnIndex(const TreeParams& params, const ColumnarDataset& data,
+                     ColumnIndex* index);
+
+// If index is binned (split_mode is histogram), release data's share of its
+// values: growing trees on the bins and making their incorrect sets reads
+// none of them. data can then only be used for training with index.
+void DropBinnedValues(const ColumnIndex& index, ColumnarDataset* data);
+
+// Return root node for a tree, and put all examples into it in partition.
+TrainingNode MakeRootNode(const ColumnarDataset& data,
+                          ExamplePartition* partition);
+
+// Copy the sorted ids of index into partition, whose nodes must all still be
+// at the root. Reuses the arrays partition already has.
+void SortPartition(const ColumnIndex& index, ExamplePartition* partition);
+
+// Split the sorted ids of partition at parent_id between its children, once
+// MakeChildNodes() has split it. Each feature's examples at the parent are
+// stably partitioned, so that every child's examples stay sorted.
+void SplitSortedIds(const TreeContext& context, const TrainingTree& tree,
+                    NodeId parent_id, ExamplePartition* partition);
+
+// Return a tree trained on data, with its training-time state. context must
+// have been set up for data, and index must be the column index of data. Nodes
+// are split in breadth-first order; growth only changes how many passes over
+// the data that takes.
+TrainingTree GrowTree(const TreeContext& context, const ColumnarDataset& data,
+                      const ColumnIndex& index);
+
+// Same as above, but keeps the per-example state of growing the tree in
+// partition. Reusing partition for every tree grown on the same data means
+// that, once its arrays have been sized for the first tree, growing the next
+// ones allocates nothing for them.
+TrainingTree GrowTree(const TreeContext& context, const ColumnarDataset& data,
+                      const ColumnIndex& index, ExamplePartition* partition);
+
+// Return the tree that classifies examples like training_tree does.
+Tree MakeTree(const TrainingTree& training_tree);
+
+// Return a tree trained on data, i.e., MakeTree(GrowTree(context, data,
+// index)).
+Tree TrainTree(const TreeContext& context, const ColumnarDataset& data,
+               const ColumnIndex& index);
+
+// Same as above, reusing partition as GrowTree() does.
+Tree TrainTree(const TreeContext& context, const ColumnarDataset& data,
+               const ColumnIndex& index, ExamplePartition* partition);
+
+// Same as above, but builds the column index of data first. Convenient for
+// one-off calls; repeated calls on the same data should build the index once
+// and use the function above.
+Tree TrainTree(const TreeContext& context, const ColumnarDataset& data);
 
 // Make child nodes using split feature/value and add them to the tree. Also
-// update info in the parent node, like child pointers.
-void MakeChildNodes(Feature split_feature, Value split_value, Node* parent,
-                    Tree* tree);
+// update info in the parent node, like child pointers. The examples at the
+// parent are stably partitioned in place between the children.
+void MakeChildNodes(const ColumnarDataset& data, Feature split_feature,
+                    Value split_value, NodeId parent_id,
+                    ExamplePartition* partition, TrainingTree* tree);
+
+// Same as above, but if index is binned, compares the bins of the examples
+// with the bin of split_value, which must be one of the bin values of
+// split_feature, instead of reading the values of data.
+void MakeChildNodes(const ColumnarDataset& data, const ColumnIndex& index,
+                    Feature split_feature, Value split_value, NodeId parent_id,
+                    ExamplePartition* partition, TrainingTree* tree);
 
 // Return a map from each value of feature to a pair of weights. The first
 // weight in the pair is the total weight of positive examples at node that have
 // that value for feature, and the second weight in the pair is the total weight
 // of negative examples at node that have that value for feature. This map is
 // used to determine the best split feature/value.
-map<Value, pair<Weight, Weight>> MakeValueToWeightsMap(const Node& node,
-                                                       Feature feature);
+map<Value, pair<Weight, Weight>> MakeValueToWeightsMap(
+    const ColumnarDataset& data, const ExamplePartition& partition,
+    const TrainingNode& node, Feature feature);
 
 // Given a value-to-weights map for a feature (constructed by
 // MakeValueToWeightsMap()), determine the best split value for the feature and
 // the improvement in the gradient of the objective if we split on that value.
 // Note that delta_gradient <= 0 indicates that we should not split on this
 // feature.
-void BestSplitValue(const map<Value, pair<Weight, Weight>>& value_to_weights,
-                    const Node& node, int tree_size, Value* split_value,
-                    float* delta_gradient);
+void BestSplitValue(const TreeContext& context,
+                    const map<Value, pair<Weight, Weight>>& value_to_weights,
+                    const TrainingNode& node, int tree_size,
+                    Value* split_value, float* delta_gradient);
+
+// Same as BestSplitValue(), but instead of a value-to-weights map makes a
+// single scan over the examples at node sorted by value of feature. If
+// partition has sorted ids (see SortPartition()), only the examples at node are
+// read; otherwise the column index of data is scanned, skipping the examples
+// not at node node_id. Picks the same split value as BestSplitValue() would on
+// the map returned by MakeValueToWeightsMap().
+void BestSplitValueSorted(const TreeContext& context,
+                          const ColumnarDataset& data,
+                          const ColumnIndex& index, Feature feature,
+                          const ExamplePartition& partition, NodeId node_id,
+                          const TrainingNode& node, int tree_size,
+                          Value* split_value, float* delta_gradient);
+
+// Return the number of sorted ids read so far, over all threads, by the split
+// searches of exact mode: BestSplitValueSorted() and the level-wise grower's
+// scans. Lets tests count the passes over the data that growing a tree takes.
+int64_t NumSortedIdsScanned();
+
+// Set histogram to the histogram of the examples at node for each feature in
+// features. The entries of other features are zero. Requires the binned part of
+// index.
+void MakeHistogram(const TreeContext& context, const ColumnarDataset& data,
+                   const ColumnIndex& index, const vector<Feature>& features,
+                   const ExamplePartition& partition, const TrainingNode& node,
+                   Histogram* histogram);
+
+// Subtract child_histogram from histogram, so that a parent's histogram becomes
+// the histogram of the child's sibling. An entry that only one child has
+// examples in ends up exactly equal to that child's entry.
+void SubtractHistogram(const Histogram& child_histogram, Histogram* histogram);
+
+// Same as BestSplitValue(), but the candidate split values are the bin
+// boundaries of feature, and the weights come from the histogram of node built
+// by MakeHistogram(). If every distinct value of feature has its own bin, picks
+// the same split value as BestSplitValue().
+void BestSplitValueHistogram(const TreeContext& context,
+                             const ColumnIndex& index, Feature feature,
+                             const Histogram& histogram,
+                             const TrainingNode& node, int tree_size,
+                             Value* split_value, float* delta_gradient);
+
+// Append tree to nodes as packed nodes, in breadth-first order, so that its
+// root comes first and the children of each node are next to each other.
+void PackTree(const Tree& tree, vector<PackedNode>* nodes);
+
+// Classify example with the packed tree whose root is root, as
+// ClassifyExample() does with the tree it was packed from.
+Label ClassifyExample(const Example& example, const PackedNode* root);
+
+// Same as above, for the example with feature values values.
+Label ClassifyExample(const Value* values, const PackedNode* root);
+
+// The deepest trees laid out in a HeapModel, which covers the tree_depth of 3
+// or 4 that models are usually trained with. Every tree of a HeapModel is
+// padded to the depth of the deepest one, so a model with a deeper tree is
+// scored faster packed, one node per level of each tree.
+static const int kMaxHeapTreeDepth = 4;
+
+// Return the depth of the deepest leaf of tree. The root has depth 0.
+int TreeDepth(const Tree& tree);
+
+// Append tree with weight to heap_model. TreeDepth(tree) must be at most
+// heap_model->depth, which must be at most kMaxHeapTreeDepth.
+void AppendHeapTree(const Tree& tree, Weight weight, HeapModel* heap_model);
 
 // Given an example and a tree, classify the example with the tree.
 // NB: This function assumes that if an example has a feature value that is
@@ -56,14 +217,36 @@ void BestSplitValue(const map<Value, pair<Weight, Weight>>& value_to_weights,
 // to the left child, and otherwise sent to the right child.
 Label ClassifyExample(const Example& example, const Tree& tree);
 
+// Same as above, for example id of data.
+Label ClassifyExample(const ColumnarDataset& data, ExampleId id,
+                      const Tree& tree);
+
 // Return the (sub)gradient of the objective with respect to a tree.
-float Gradient(float wgtd_error, int tree_size, float alpha, int sign_edge);
+float Gradient(const TreeContext& context, float wgtd_error, int tree_size,
+               float alpha, int sign_edge);
 
 // Given a set of examples and a tree, return the weighted error of tree on
 // the examples.
-float EvaluateTreeWgtd(const vector<Example>& examples, const Tree& tree);
+float EvaluateTreeWgtd(const ColumnarDataset& data, const Tree& tree);
+
+// Set incorrect to the examples of data that tree misclassifies.
+void MakeIncorrectSet(const ColumnarDataset& data, const Tree& tree,
+                      ExampleSet* incorrect);
+
+// Same as above, for the tree just grown from data in partition. Looks up the
+// leaf of each example in partition instead of classifying it, so it reads no
+// values of data.
+void MakeIncorrectSet(const ColumnarDataset& data, const Tree& tree,
+                      const ExamplePartition& partition,
+                      ExampleSet* incorrect);
+
+// Return the total of weights over the examples in incorrect. Same as
+// EvaluateTreeWgtd() with the weights of data if incorrect was made by
+// MakeIncorrectSet() from data and tree, without classifying any example.
+float EvaluateTreeWgtd(const ExampleSet& incorrect,
+                       const vector<Weight>& weights);
 
 // Return complexity penalty.
-float ComplexityPenalty(int tree_size);
+float ComplexityPenalty(const TreeContext& context, int tree_size);
 
 #endif  // TREE_H_
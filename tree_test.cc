@@ -14,6 +14,10 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <math.h>
+
+#include <limits>
+
 #include "srm_test.h"
 #include "tree.h"
 
@@ -23,18 +27,37 @@ limitations under the License.
 DECLARE_int32(tree_depth);
 DECLARE_double(beta);
 DECLARE_double(lambda);
+DECLARE_string(split_mode);
+DECLARE_int32(max_bins);
+DECLARE_int32(num_threads);
+DECLARE_string(growth);
+DECLARE_int32(max_leaves);
 
 class TreeTest : public SrmTest {
  protected:
   virtual void SetUp() {
     SrmTest::SetUp();
-    InitializeTreeData(examples_, examples_.size());
+    MakeColumnarDataset(examples_, &data_);
+  }
+
+  // Return the context of data with the tree params given by the flags.
+  TreeContext Context(const ColumnarDataset& data) {
+    TreeContext context;
+    InitializeTreeContext(TreeParamsFromFlags(), data, data.num_examples,
+                          &context);
+    return context;
   }
+
+  ColumnarDataset data_;
 };
 
 TEST_F(TreeTest, TestMakeRootNode) {
-  Node root = MakeRootNode(examples_);
-  EXPECT_EQ(5, root.examples.size());
+  ExamplePartition partition;
+  TrainingNode root = MakeRootNode(data_, &partition);
+  EXPECT_EQ(0, root.begin);
+  EXPECT_EQ(5, root.end);
+  EXPECT_EQ(vector<ExampleId>({0, 1, 2, 3, 4}), partition.example_ids);
+  EXPECT_EQ(vector<NodeId>({0, 0, 0, 0, 0}), partition.example_node);
   EXPECT_NEAR(0.6, root.positive_weight, kTolerance);
   EXPECT_NEAR(0.4, root.negative_weight, kTolerance);
   EXPECT_TRUE(root.leaf);
@@ -42,11 +65,12 @@ TEST_F(TreeTest, TestMakeRootNode) {
 }
 
 TEST_F(TreeTest, TestMakeValueToWeightsMap) {
-  Node root = MakeRootNode(examples_);
+  ExamplePartition partition;
+  TrainingNode root = MakeRootNode(data_, &partition);
   map<Value, pair<Weight, Weight>> value_to_weights;
 
   // Sort by first feature
-  value_to_weights = MakeValueToWeightsMap(root, 0);
+  value_to_weights = MakeValueToWeightsMap(data_, partition, root, 0);
   vector<Value> values_for_0 = {1.0, 2.0, 3.0, 4.0, 5.0};
   vector<Weight> positive_weights_for_0 = {0.2, 0.0, 0.2, 0.0, 0.2};
   vector<Weight> negative_weights_for_0 = {0.0, 0.2, 0.0, 0.2, 0.0};
@@ -59,7 +83,7 @@ TEST_F(TreeTest, TestMakeValueToWeightsMap) {
   }
 
   // Sort by second feature
-  value_to_weights = MakeValueToWeightsMap(root, 1);
+  value_to_weights = MakeValueToWeightsMap(data_, partition, root, 1);
   vector<Value> values_for_1 = {0.1, 0.2, 0.3, 0.4, 0.5};
   vector<Weight> positive_weights_for_1 = {0.2, 0.0, 0.2, 0.2, 0.0};
   vector<Weight> negative_weights_for_1 = {0.0, 0.2, 0.0, 0.0, 0.2};
@@ -73,7 +97,8 @@ TEST_F(TreeTest, TestMakeValueToWeightsMap) {
 }
 
 TEST_F(TreeTest, TestBestSplitValue) {
-  Node root = MakeRootNode(examples_);
+  ExamplePartition partition;
+  TrainingNode root = MakeRootNode(data_, &partition);
   map<Value, pair<Weight, Weight>> value_to_weights;
   Value split_value;
   float delta_gradient;
@@ -83,32 +108,271 @@ TEST_F(TreeTest, TestBestSplitValue) {
   FLAGS_beta = 0;
 
   // Split on first feature, which is useless.
-  value_to_weights = MakeValueToWeightsMap(root, 0);
-  BestSplitValue(value_to_weights, root, 1, &split_value, &delta_gradient);
+  value_to_weights = MakeValueToWeightsMap(data_, partition, root, 0);
+  BestSplitValue(Context(data_), value_to_weights, root, 1, &split_value,
+                 &delta_gradient);
   EXPECT_NEAR(0, delta_gradient, kTolerance);
 
   // Split on second feature, which is useful.
-  value_to_weights = MakeValueToWeightsMap(root, 1);
-  BestSplitValue(value_to_weights, root, 1, &split_value, &delta_gradient);
+  value_to_weights = MakeValueToWeightsMap(data_, partition, root, 1);
+  BestSplitValue(Context(data_), value_to_weights, root, 1, &split_value,
+                 &delta_gradient);
   EXPECT_NEAR(0.2, delta_gradient, kTolerance);
   EXPECT_NEAR(0.4, split_value, kTolerance);
 
   // Don't split on second feature if complexity penalty is very high.
   FLAGS_lambda = 100;
-  value_to_weights = MakeValueToWeightsMap(root, 1);
-  BestSplitValue(value_to_weights, root, 1, &split_value, &delta_gradient);
+  value_to_weights = MakeValueToWeightsMap(data_, partition, root, 1);
+  BestSplitValue(Context(data_), value_to_weights, root, 1, &split_value,
+                 &delta_gradient);
   EXPECT_NEAR(delta_gradient, 0, kTolerance);
 }
 
+TEST_F(TreeTest, TestBestSplitValueManyCandidates) {
+  FLAGS_beta = 0.001;
+  FLAGS_lambda = 0.001;
+  // Enough candidates to fill several blocks of the vectorized scoring, and
+  // a tail.
+  map<Value, pair<Weight, Weight>> value_to_weights;
+  TrainingNode node;
+  node.positive_weight = node.negative_weight = 0;
+  for (int i = 0; i < 45; ++i) {
+    const Weight positive_weight = ((i * 7) % 5) / 200.0;
+    const Weight negative_weight = ((i * 3) % 4) / 200.0;
+    value_to_weights[i] = {positive_weight, negative_weight};
+    node.positive_weight += positive_weight;
+    node.negative_weight += negative_weight;
+  }
+  // Score each candidate the slow way.
+  const float old_gradient = Gradient(
+      Context(data_), fmin(node.positive_weight, node.negative_weight), 3, 0,
+      -1);
+  Weight left_positive_weight = 0, left_negative_weight = 0,
+         right_positive_weight = node.positive_weight,
+         right_negative_weight = node.negative_weight;
+  Value expected_split_value = -1;
+  float expected_delta_gradient = 0;
+  for (const pair<const Value, pair<Weight, Weight>>& elem : value_to_weights) {
+    left_positive_weight += elem.second.first;
+    right_positive_weight -= elem.second.first;
+    left_negative_weight += elem.second.second;
+    right_negative_weight -= elem.second.second;
+    const float new_gradient =
+        Gradient(Context(data_),
+                 fmin(left_positive_weight, left_negative_weight) +
+                     fmin(right_positive_weight, right_negative_weight),
+                 5, 0, -1);
+    const float delta_gradient = fabs(new_gradient) - fabs(old_gradient);
+    if (delta_gradient > expected_delta_gradient + kTolerance) {
+      expected_delta_gradient = delta_gradient;
+      expected_split_value = elem.first;
+    }
+  }
+  EXPECT_LT(0, expected_delta_gradient);
+  Value split_value = -1;
+  float delta_gradient;
+  BestSplitValue(Context(data_), value_to_weights, node, 3, &split_value,
+                 &delta_gradient);
+  EXPECT_EQ(expected_split_value, split_value);
+  EXPECT_EQ(expected_delta_gradient, delta_gradient);
+}
+
+TEST_F(TreeTest, TestMakeColumnarDataset) {
+  EXPECT_EQ(5, data_.num_examples);
+  EXPECT_EQ(3, data_.num_features);
+  EXPECT_EQ(vector<Value>({0.1, 0.3, 0.4, 0.2, 0.5}),
+            vector<Value>(data_.column(1), data_.column(1) + 5));
+  EXPECT_EQ(22.0, data_.value(3, 2));
+  EXPECT_EQ(vector<Label>({1, 1, 1, -1, -1}), data_.labels);
+  EXPECT_NEAR(0.2, data_.weights[4], kTolerance);
+}
+
+TEST_F(TreeTest, TestMakeColumnIndex) {
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data_, &index);
+  ASSERT_EQ(3, index.sorted_ids.size());
+  EXPECT_EQ(vector<ExampleId>({0, 3, 1, 4, 2}), index.sorted_ids[0]);
+  EXPECT_EQ(vector<ExampleId>({0, 3, 1, 2, 4}), index.sorted_ids[1]);
+  // Ties are kept in training set order.
+  EXPECT_EQ(vector<ExampleId>({0, 1, 2, 4, 3}), index.sorted_ids[2]);
+}
+
+TEST_F(TreeTest, TestBestSplitValueSorted) {
+  FLAGS_lambda = 0;
+  FLAGS_beta = 0;
+  // Many repeated values and non-uniform weights, so that the scan has to
+  // handle runs of equal values the same way the map does.
+  vector<Example> examples(50);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    examples[i].values = {static_cast<Value>(i % 7), static_cast<Value>(i % 3),
+                          static_cast<Value>((i * 13) % 11)};
+    examples[i].label = (i % 5 < 2) ? 1 : -1;
+    examples[i].weight = (1 + i % 4) / 125.0;
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data, &index);
+  ExamplePartition partition;
+  TrainingTree tree;
+  tree.push_back(MakeRootNode(data, &partition));
+  for (Feature feature = 0; feature < 3; ++feature) {
+    Value split_value = -1, sorted_split_value = -1;
+    float delta_gradient, sorted_delta_gradient;
+    BestSplitValue(Context(data),
+                   MakeValueToWeightsMap(data, partition, tree[0], feature),
+                   tree[0], 1, &split_value, &delta_gradient);
+    BestSplitValueSorted(Context(data), data, index, feature, partition, 0,
+                         tree[0], 1, &sorted_split_value,
+                         &sorted_delta_gradient);
+    EXPECT_EQ(split_value, sorted_split_value);
+    EXPECT_EQ(delta_gradient, sorted_delta_gradient);
+  }
+
+  // Only the examples at the given node are scanned, whether the scan skips
+  // the other examples or reads the node's own sorted ids.
+  ExamplePartition sorted_partition = partition;
+  SortPartition(index, &sorted_partition);
+  TrainingTree sorted_tree = tree;
+  MakeChildNodes(data, 0, 2.0, 0, &partition, &tree);
+  MakeChildNodes(data, 0, 2.0, 0, &sorted_partition, &sorted_tree);
+  SplitSortedIds(Context(data), sorted_tree, 0, &sorted_partition);
+  for (NodeId node_id = 1; node_id <= 2; ++node_id) {
+    for (Feature feature = 0; feature < 3; ++feature) {
+      Value split_value = -1, sorted_split_value = -1,
+            node_sorted_split_value = -1;
+      float delta_gradient, sorted_delta_gradient, node_sorted_delta_gradient;
+      BestSplitValue(
+          Context(data),
+          MakeValueToWeightsMap(data, partition, tree[node_id], feature),
+          tree[node_id], 3, &split_value, &delta_gradient);
+      BestSplitValueSorted(Context(data), data, index, feature, partition,
+                           node_id, tree[node_id], 3, &sorted_split_value,
+                           &sorted_delta_gradient);
+      BestSplitValueSorted(Context(data), data, index, feature,
+                           sorted_partition, node_id, sorted_tree[node_id], 3,
+                           &node_sorted_split_value,
+                           &node_sorted_delta_gradient);
+      EXPECT_EQ(split_value, sorted_split_value);
+      EXPECT_EQ(delta_gradient, sorted_delta_gradient);
+      EXPECT_EQ(split_value, node_sorted_split_value);
+      EXPECT_EQ(delta_gradient, node_sorted_delta_gradient);
+    }
+  }
+}
+
+TEST_F(TreeTest, TestMakeColumnIndexHistogram) {
+  FLAGS_split_mode = "histogram";
+  FLAGS_max_bins = 255;
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data_, &index);
+  EXPECT_TRUE(index.sorted_ids.empty());
+  // Few distinct values, so every value has its own bin.
+  EXPECT_EQ(vector<Value>({1.0, 2.0, 3.0, 4.0, 5.0}), index.bin_values[0]);
+  EXPECT_EQ(vector<Value>({11.0, 22.0}), index.bin_values[2]);
+  EXPECT_EQ(vector<int>({0, 5, 10, 12}), index.bin_offsets);
+  // Bins of example 3 for feature 2 and of example 4 for feature 1.
+  EXPECT_EQ(1, index.bins[3 * 3 + 2]);
+  EXPECT_EQ(4, index.bins[4 * 3 + 1]);
+
+  // More distinct values than bins.
+  vector<Example> examples(1000);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    examples[i].values = {static_cast<Value>(i)};
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  FLAGS_max_bins = 10;
+  MakeColumnIndex(TreeParamsFromFlags(), data, &index);
+  ASSERT_EQ(10, index.bin_values[0].size());
+  EXPECT_EQ(99, index.bin_values[0][0]);
+  EXPECT_EQ(999, index.bin_values[0][9]);
+  EXPECT_EQ(0, index.bins[99]);
+  EXPECT_EQ(1, index.bins[100]);
+  EXPECT_EQ(9, index.bins[999]);
+  FLAGS_split_mode = "exact";
+  FLAGS_max_bins = 255;
+}
+
+TEST_F(TreeTest, TestBestSplitValueHistogram) {
+  FLAGS_lambda = 0;
+  FLAGS_beta = 0;
+  FLAGS_split_mode = "histogram";
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data_, &index);
+  ExamplePartition partition;
+  TrainingNode root = MakeRootNode(data_, &partition);
+  Histogram histogram;
+  MakeHistogram(Context(data_), data_, index, {0, 1, 2}, partition, root,
+                &histogram);
+  // Feature 0, value 3.0.
+  EXPECT_NEAR(0.2, histogram[2].positive_weight, kTolerance);
+  EXPECT_NEAR(0.0, histogram[2].negative_weight, kTolerance);
+  EXPECT_EQ(1, histogram[2].num_examples);
+  // Feature 2, value 11.0.
+  EXPECT_NEAR(0.6, histogram[10].positive_weight, kTolerance);
+  EXPECT_NEAR(0.2, histogram[10].negative_weight, kTolerance);
+  EXPECT_EQ(4, histogram[10].num_examples);
+  // Every value has its own bin, so the splits match BestSplitValue().
+  for (Feature feature = 0; feature < 3; ++feature) {
+    Value split_value = -1, histogram_split_value = -1;
+    float delta_gradient, histogram_delta_gradient;
+    BestSplitValue(Context(data_),
+                   MakeValueToWeightsMap(data_, partition, root, feature),
+                   root, 1, &split_value, &delta_gradient);
+    BestSplitValueHistogram(Context(data_), index, feature, histogram, root, 1,
+                            &histogram_split_value, &histogram_delta_gradient);
+    EXPECT_EQ(split_value, histogram_split_value);
+    EXPECT_EQ(delta_gradient, histogram_delta_gradient);
+  }
+
+  FLAGS_tree_depth = 2;
+  Tree tree = TrainTree(Context(data_), data_);
+  EXPECT_EQ(5, tree.size());
+  EXPECT_EQ(1, tree[0].split_feature);
+  EXPECT_NEAR(0.4, tree[0].split_value, kTolerance);
+  EXPECT_EQ(2, tree[1].split_feature);
+  EXPECT_NEAR(11.0, tree[1].split_value, kTolerance);
+  FLAGS_split_mode = "exact";
+}
+
+TEST_F(TreeTest, TestSubtractHistogram) {
+  FLAGS_split_mode = "histogram";
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data_, &index);
+  ExamplePartition partition;
+  TrainingTree tree;
+  tree.push_back(MakeRootNode(data_, &partition));
+  Histogram histogram, left_histogram, right_histogram;
+  MakeHistogram(Context(data_), data_, index, {0, 1, 2}, partition, tree[0],
+                &histogram);
+  MakeChildNodes(data_, 1, 0.4, 0, &partition, &tree);
+  MakeHistogram(Context(data_), data_, index, {0, 1, 2}, partition, tree[1],
+                &left_histogram);
+  MakeHistogram(Context(data_), data_, index, {0, 1, 2}, partition, tree[2],
+                &right_histogram);
+  SubtractHistogram(left_histogram, &histogram);
+  ASSERT_EQ(right_histogram.size(), histogram.size());
+  for (size_t i = 0; i < histogram.size(); ++i) {
+    EXPECT_NEAR(right_histogram[i].positive_weight,
+                histogram[i].positive_weight, kTolerance);
+    EXPECT_NEAR(right_histogram[i].negative_weight,
+                histogram[i].negative_weight, kTolerance);
+    EXPECT_EQ(right_histogram[i].num_examples, histogram[i].num_examples);
+  }
+  FLAGS_split_mode = "exact";
+}
+
 TEST_F(TreeTest, TestMakeChildNodes) {
-  Node root = MakeRootNode(examples_);
-  Tree tree;
+  ExamplePartition partition;
+  TrainingNode root = MakeRootNode(data_, &partition);
+  TrainingTree tree;
 
   tree.push_back(root);
-  MakeChildNodes(0, 3.0, &tree[0], &tree);
+  MakeChildNodes(data_, 0, 3.0, 0, &partition, &tree);
   EXPECT_EQ(3, tree.size());
   // Check root node
-  EXPECT_EQ(5, tree[0].examples.size());
+  EXPECT_EQ(5, tree[0].end - tree[0].begin);
   EXPECT_EQ(0, tree[0].split_feature);
   EXPECT_EQ(1, tree[0].left_child_id);
   EXPECT_EQ(2, tree[0].right_child_id);
@@ -118,24 +382,29 @@ TEST_F(TreeTest, TestMakeChildNodes) {
   EXPECT_FALSE(tree[0].leaf);
   EXPECT_EQ(0, tree[0].depth);
   // Check left child node
-  EXPECT_EQ(3, tree[1].examples.size());
+  EXPECT_EQ(3, tree[1].end - tree[1].begin);
   EXPECT_NEAR(0.4, tree[1].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[1].negative_weight, kTolerance);
   EXPECT_TRUE(tree[1].leaf);
   EXPECT_EQ(1, tree[1].depth);
   // Check right child node
-  EXPECT_EQ(2, tree[2].examples.size());
+  EXPECT_EQ(2, tree[2].end - tree[2].begin);
   EXPECT_NEAR(0.2, tree[2].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[2].negative_weight, kTolerance);
   EXPECT_TRUE(tree[2].leaf);
   EXPECT_EQ(1, tree[2].depth);
 
+  // The left child's examples come first, in their original order.
+  EXPECT_EQ(vector<ExampleId>({0, 1, 3, 2, 4}), partition.example_ids);
+  EXPECT_EQ(vector<NodeId>({1, 1, 2, 1, 2}), partition.example_node);
+
   tree.clear();
+  root = MakeRootNode(data_, &partition);
   tree.push_back(root);
-  MakeChildNodes(1, 0.4, &tree[0], &tree);
+  MakeChildNodes(data_, 1, 0.4, 0, &partition, &tree);
   EXPECT_EQ(3, tree.size());
   // Check root node
-  EXPECT_EQ(5, tree[0].examples.size());
+  EXPECT_EQ(5, tree[0].end - tree[0].begin);
   EXPECT_EQ(1, tree[0].split_feature);
   EXPECT_NEAR(0.4, tree[0].split_value, kTolerance);
   EXPECT_EQ(1, tree[0].left_child_id);
@@ -145,29 +414,34 @@ TEST_F(TreeTest, TestMakeChildNodes) {
   EXPECT_FALSE(tree[0].leaf);
   EXPECT_EQ(0, tree[0].depth);
   // Check left child node
-  EXPECT_EQ(4, tree[1].examples.size());
+  EXPECT_EQ(4, tree[1].end - tree[1].begin);
   EXPECT_NEAR(0.6, tree[1].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[1].negative_weight, kTolerance);
   EXPECT_TRUE(tree[1].leaf);
   EXPECT_EQ(1, tree[1].depth);
   // Check right child node
-  EXPECT_EQ(1, tree[2].examples.size());
+  EXPECT_EQ(1, tree[2].end - tree[2].begin);
+  EXPECT_EQ(vector<ExampleId>({0, 1, 2, 3, 4}), partition.example_ids);
+  EXPECT_EQ(4, tree[2].begin);
   EXPECT_NEAR(0.0, tree[2].positive_weight, kTolerance);
   EXPECT_NEAR(0.2, tree[2].negative_weight, kTolerance);
   EXPECT_TRUE(tree[2].leaf);
   EXPECT_EQ(1, tree[2].depth);
 }
 
-TEST_F(TreeTest, TestTrainTree) {
+TEST_F(TreeTest, TestGrowTree) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
 
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data_, &index);
+
   FLAGS_tree_depth = 1;
-  Tree tree = TrainTree(examples_);
+  TrainingTree tree = GrowTree(Context(data_), data_, index);
   EXPECT_EQ(3, tree.size());
 
   FLAGS_tree_depth = 2;
-  tree = TrainTree(examples_);
+  tree = GrowTree(Context(data_), data_, index);
   EXPECT_EQ(5, tree.size());
 
   // Check all the nodes
@@ -207,52 +481,290 @@ TEST_F(TreeTest, TestTrainTree) {
 
   // Very high complexity penalty causes tree to never split
   FLAGS_lambda = 100;
-  tree = TrainTree(examples_);
+  tree = GrowTree(Context(data_), data_, index);
   EXPECT_EQ(1, tree.size());
 }
 
+TEST_F(TreeTest, TestTrainTree) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 2;
+  Tree tree = TrainTree(Context(data_), data_);
+  ASSERT_EQ(5, tree.size());
+  // Internal nodes keep their splits, and leaves their predicted labels.
+  EXPECT_FALSE(tree[0].leaf);
+  EXPECT_EQ(1, tree[0].split_feature);
+  EXPECT_NEAR(0.4, tree[0].split_value, kTolerance);
+  EXPECT_EQ(1, tree[0].left_child_id);
+  EXPECT_EQ(2, tree[0].right_child_id);
+  EXPECT_FALSE(tree[1].leaf);
+  EXPECT_EQ(2, tree[1].split_feature);
+  EXPECT_NEAR(11.0, tree[1].split_value, kTolerance);
+  EXPECT_EQ(3, tree[1].left_child_id);
+  EXPECT_EQ(4, tree[1].right_child_id);
+  EXPECT_TRUE(tree[2].leaf);
+  EXPECT_EQ(-1, tree[2].label);
+  EXPECT_TRUE(tree[3].leaf);
+  EXPECT_EQ(1, tree[3].label);
+  EXPECT_TRUE(tree[4].leaf);
+  EXPECT_EQ(-1, tree[4].label);
+
+  // Very high complexity penalty causes tree to never split
+  FLAGS_lambda = 100;
+  tree = TrainTree(Context(data_), data_);
+  ASSERT_EQ(1, tree.size());
+  EXPECT_TRUE(tree[0].leaf);
+  EXPECT_EQ(1, tree[0].label);
+}
+
+TEST_F(TreeTest, TestGrowTreeNumThreads) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 4;
+  // Features 0 and 4 are identical, and so are features 1 and 5, so that
+  // equally good splits must be broken toward the lower feature id.
+  vector<Example> examples(200);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    const Value a = i % 17, b = (i * 7) % 13;
+    examples[i].values = {a, b, static_cast<Value>(i % 5),
+                          static_cast<Value>((i * 3) % 29), a, b};
+    examples[i].label = (a < 6 || (b > 9 && i % 5 != 0)) ? 1 : -1;
+    examples[i].weight = (1 + i % 3) / 400.0;
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  for (const char* split_mode : {"exact", "histogram"}) {
+    FLAGS_split_mode = split_mode;
+    ColumnIndex index;
+    MakeColumnIndex(TreeParamsFromFlags(), data, &index);
+    FLAGS_num_threads = 1;
+    const TrainingTree tree = GrowTree(Context(data), data, index);
+    EXPECT_LT(1, tree.size());
+    for (int num_threads : {2, 4, 7}) {
+      FLAGS_num_threads = num_threads;
+      const TrainingTree threaded_tree = GrowTree(Context(data), data, index);
+      ASSERT_EQ(tree.size(), threaded_tree.size());
+      for (size_t i = 0; i < tree.size(); ++i) {
+        EXPECT_EQ(tree[i].leaf, threaded_tree[i].leaf);
+        if (tree[i].leaf) continue;
+        EXPECT_EQ(tree[i].split_feature, threaded_tree[i].split_feature);
+        EXPECT_GT(4, tree[i].split_feature);
+        EXPECT_EQ(tree[i].split_value, threaded_tree[i].split_value);
+        EXPECT_EQ(tree[i].left_child_id, threaded_tree[i].left_child_id);
+      }
+    }
+  }
+  FLAGS_split_mode = "exact";
+  FLAGS_num_threads = 1;
+}
+
+TEST_F(TreeTest, TestGrowTreeHistogramWithoutValues) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 3;
+  FLAGS_split_mode = "histogram";
+  FLAGS_max_bins = 6;
+  // More distinct values than bins, so that each bin holds several values.
+  vector<Example> examples(200);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    const Value a = i % 23, b = (i * 7) % 31;
+    examples[i].values = {a, b, static_cast<Value>(i % 5)};
+    examples[i].label = (a < 9 || b > 24) ? 1 : -1;
+    examples[i].weight = 1.0 / examples.size();
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data, &index);
+  ColumnarDataset binned_data = data;
+  DropBinnedValues(index, &binned_data);
+  EXPECT_EQ(nullptr, binned_data.values);
+  for (const char* growth : {"breadth_first", "level_wise", "best_first"}) {
+    FLAGS_growth = growth;
+    const TrainingTree training_tree = GrowTree(Context(data), data, index);
+    ExamplePartition partition;
+    const TrainingTree binned_training_tree =
+        GrowTree(Context(binned_data), binned_data, index, &partition);
+    ASSERT_EQ(training_tree.size(), binned_training_tree.size());
+    EXPECT_LT(1, training_tree.size());
+    for (size_t i = 0; i < training_tree.size(); ++i) {
+      EXPECT_EQ(training_tree[i].positive_weight,
+                binned_training_tree[i].positive_weight);
+      EXPECT_EQ(training_tree[i].negative_weight,
+                binned_training_tree[i].negative_weight);
+    }
+    const Tree tree = MakeTree(binned_training_tree);
+    ExampleSet incorrect, binned_incorrect;
+    MakeIncorrectSet(data, tree, &incorrect);
+    MakeIncorrectSet(binned_data, tree, partition, &binned_incorrect);
+    EXPECT_EQ(incorrect, binned_incorrect);
+  }
+  FLAGS_split_mode = "exact";
+  FLAGS_max_bins = 255;
+  FLAGS_growth = "breadth_first";
+}
+
+TEST_F(TreeTest, TestGrowTreeLevelWise) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0.001;
+  // Labels depend on a few features, so that some nodes become pure and are
+  // not split, and the nodes after them at the same depth are reached with a
+  // smaller tree than if every node were split.
+  vector<Example> examples(300);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    const Value a = i % 19, b = (i * 7) % 23, c = (i * 5) % 11;
+    examples[i].values = {a, b, c, static_cast<Value>(i % 4)};
+    examples[i].label = (a < 5 || (b > 15 && c < 6)) ? 1 : -1;
+    examples[i].weight = (1 + i % 5) / 900.0;
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  for (const char* split_mode : {"exact", "histogram"}) {
+    FLAGS_split_mode = split_mode;
+    ColumnIndex index;
+    MakeColumnIndex(TreeParamsFromFlags(), data, &index);
+    for (int tree_depth : {1, 3, 5}) {
+      FLAGS_tree_depth = tree_depth;
+      FLAGS_growth = "breadth_first";
+      const TrainingTree tree = GrowTree(Context(data), data, index);
+      FLAGS_growth = "level_wise";
+      const int64_t num_scanned = NumSortedIdsScanned();
+      const TrainingTree level_wise_tree = GrowTree(Context(data), data, index);
+      // In exact mode, one pass over every feature's sorted ids per level,
+      // even where nodes are scored again for a smaller tree.
+      EXPECT_LE(NumSortedIdsScanned() - num_scanned,
+                tree_depth * data.num_examples * data.num_features);
+      ASSERT_EQ(tree.size(), level_wise_tree.size());
+      for (size_t i = 0; i < tree.size(); ++i) {
+        EXPECT_EQ(tree[i].leaf, level_wise_tree[i].leaf);
+        EXPECT_EQ(tree[i].depth, level_wise_tree[i].depth);
+        EXPECT_EQ(tree[i].positive_weight, level_wise_tree[i].positive_weight);
+        EXPECT_EQ(tree[i].negative_weight, level_wise_tree[i].negative_weight);
+        if (tree[i].leaf) continue;
+        EXPECT_EQ(tree[i].split_feature, level_wise_tree[i].split_feature);
+        EXPECT_EQ(tree[i].split_value, level_wise_tree[i].split_value);
+        EXPECT_EQ(tree[i].left_child_id, level_wise_tree[i].left_child_id);
+      }
+    }
+  }
+  FLAGS_split_mode = "exact";
+  FLAGS_growth = "breadth_first";
+}
+
+TEST_F(TreeTest, TestGrowTreeBestFirst) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 2;
+  FLAGS_growth = "best_first";
+  ColumnIndex index;
+  MakeColumnIndex(TreeParamsFromFlags(), data_, &index);
+  FLAGS_max_leaves = 1;
+  EXPECT_EQ(1, GrowTree(Context(data_), data_, index).size());
+  FLAGS_max_leaves = 2;
+  TrainingTree tree = GrowTree(Context(data_), data_, index);
+  ASSERT_EQ(3, tree.size());
+  EXPECT_EQ(1, tree[0].split_feature);
+  EXPECT_NEAR(0.4, tree[0].split_value, kTolerance);
+  // Only the left child of the root is impure, so it is split next, and the
+  // tree ends up the same as with breadth-first growth.
+  FLAGS_max_leaves = 16;
+  tree = GrowTree(Context(data_), data_, index);
+  ASSERT_EQ(5, tree.size());
+  EXPECT_FALSE(tree[1].leaf);
+  EXPECT_EQ(2, tree[1].split_feature);
+  EXPECT_NEAR(11.0, tree[1].split_value, kTolerance);
+  EXPECT_TRUE(tree[2].leaf);
+  FLAGS_growth = "breadth_first";
+}
+
+TEST_F(TreeTest, TestGrowTreeBestFirstMaxLeaves) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 10;
+  vector<Example> examples(300);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    const Value a = i % 19, b = (i * 7) % 23, c = (i * 5) % 11;
+    examples[i].values = {a, b, c};
+    examples[i].label = ((i * 13) % 10 < 4) != (a < 5) ? 1 : -1;
+    examples[i].weight = 1.0 / 300;
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  for (const char* split_mode : {"exact", "histogram"}) {
+    FLAGS_split_mode = split_mode;
+    ColumnIndex index;
+    MakeColumnIndex(TreeParamsFromFlags(), data, &index);
+    FLAGS_growth = "best_first";
+    float previous_error = 1;
+    for (int max_leaves : {2, 3, 4, 5, 6}) {
+      FLAGS_max_leaves = max_leaves;
+      const Tree tree = TrainTree(Context(data), data, index);
+      EXPECT_EQ(2 * max_leaves - 1, tree.size());
+      // Each further split only lowers the training error.
+      const float error = EvaluateTreeWgtd(data, tree);
+      EXPECT_GE(previous_error, error);
+      previous_error = error;
+    }
+  }
+  FLAGS_split_mode = "exact";
+  FLAGS_growth = "breadth_first";
+}
+
 TEST_F(TreeTest, TestComplexityPenalty) {
   FLAGS_beta = 1;
   FLAGS_lambda = 1;
 
-  float complexity_penalty = ComplexityPenalty(10);
+  float complexity_penalty = ComplexityPenalty(Context(data_), 10);
   EXPECT_NEAR(2.48087078356, complexity_penalty, kTolerance);
 }
 
+TEST_F(TreeTest, TestTreeParamsKeepDoubleRegularization) {
+  // Values that a float cannot hold exactly.
+  FLAGS_beta = 0.1;
+  FLAGS_lambda = 1e-10;
+  const TreeParams params = TreeParamsFromFlags();
+  EXPECT_EQ(FLAGS_beta, params.beta);
+  EXPECT_EQ(FLAGS_lambda, params.lambda);
+}
+
 TEST_F(TreeTest, GradientTest) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
 
-  float gradient = Gradient(0.25, 100, 4, -1);
+  float gradient = Gradient(Context(data_), 0.25, 100, 4, -1);
   EXPECT_NEAR(0.25 - 0.5, gradient, kTolerance);
 
   FLAGS_beta = 1;
   FLAGS_lambda = 1;
 
-  gradient = Gradient(0.25, 10, 1, 1);
-  EXPECT_NEAR(0.25 - 0.5 + ComplexityPenalty(10), gradient, kTolerance);
+  gradient = Gradient(Context(data_), 0.25, 10, 1, 1);
+  EXPECT_NEAR(0.25 - 0.5 + ComplexityPenalty(Context(data_), 10),
+              gradient, kTolerance);
 
-  gradient = Gradient(0.25, 10, -1, 1);
-  EXPECT_NEAR(0.25 - 0.5 - ComplexityPenalty(10), gradient, kTolerance);
+  gradient = Gradient(Context(data_), 0.25, 10, -1, 1);
+  EXPECT_NEAR(0.25 - 0.5 - ComplexityPenalty(Context(data_), 10),
+              gradient, kTolerance);
 
-  gradient = Gradient(0.25, 10, 0, 1);
+  gradient = Gradient(Context(data_), 0.25, 10, 0, 1);
   EXPECT_NEAR(0, gradient, kTolerance);
 
   FLAGS_beta = 0;
   FLAGS_lambda = 0.1;
 
-  gradient = Gradient(0.2, 10, 0, 1);
-  EXPECT_NEAR(0.2 - 0.5 - ComplexityPenalty(10), gradient, kTolerance);
+  gradient = Gradient(Context(data_), 0.2, 10, 0, 1);
+  EXPECT_NEAR(0.2 - 0.5 - ComplexityPenalty(Context(data_), 10),
+              gradient, kTolerance);
 
-  gradient = Gradient(0.2, 10, 0, -1);
-  EXPECT_NEAR(0.2 - 0.5 + ComplexityPenalty(10), gradient, kTolerance);
+  gradient = Gradient(Context(data_), 0.2, 10, 0, -1);
+  EXPECT_NEAR(0.2 - 0.5 + ComplexityPenalty(Context(data_), 10),
+              gradient, kTolerance);
 }
 
 TEST_F(TreeTest, TestClassifyExample) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_tree_depth = 2;
-  Tree tree = TrainTree(examples_);
+  Tree tree = TrainTree(Context(data_), data_);
 
   EXPECT_EQ(1, ClassifyExample(examples_[0], tree));
   EXPECT_EQ(1, ClassifyExample(examples_[1], tree));
@@ -261,10 +773,103 @@ TEST_F(TreeTest, TestClassifyExample) {
   EXPECT_EQ(-1, ClassifyExample(examples_[4], tree));
 }
 
+TEST_F(TreeTest, TestClassifyExamplePackedTree) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 2;
+  Tree tree = TrainTree(Context(data_), data_);
+  ASSERT_EQ(5, tree.size());
+  // Pack the tree after another one, so that its root is not the first node.
+  vector<PackedNode> nodes;
+  PackTree(Tree(1, tree[tree.size() - 1]), &nodes);
+  ASSERT_EQ(1, nodes.size());
+  PackTree(tree, &nodes);
+  ASSERT_EQ(6, nodes.size());
+  const PackedNode* root = &nodes[1];
+  EXPECT_EQ(tree[0].split_feature, root->split_feature);
+  EXPECT_EQ(tree[0].split_value, root->split_value);
+  EXPECT_EQ(1, root->left_child_id);
+  for (const PackedNode& node : nodes) {
+    if (node.split_feature < 0) {
+      EXPECT_TRUE(node.split_value == 1 || node.split_value == -1);
+    }
+  }
+  for (const Example& example : examples_) {
+    EXPECT_EQ(ClassifyExample(example, tree), ClassifyExample(example, root));
+    // Missing values go the same way as in the tree.
+    Example nan_example = example;
+    nan_example.values[tree[0].split_feature] =
+        std::numeric_limits<Value>::quiet_NaN();
+    EXPECT_EQ(ClassifyExample(nan_example, tree),
+              ClassifyExample(nan_example, root));
+  }
+}
+
+TEST_F(TreeTest, TestAppendHeapTree) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 2;
+  Tree tree = TrainTree(Context(data_), data_);
+  ASSERT_EQ(2, TreeDepth(tree));
+  EXPECT_EQ(0, TreeDepth(Tree(1, tree[tree.size() - 1])));
+  // Lay the tree out one level deeper than it is, so that all of its leaves
+  // are padded.
+  HeapModel heap_model;
+  heap_model.depth = 3;
+  AppendHeapTree(tree, 0.5, &heap_model);
+  ASSERT_EQ(1, heap_model.weights.size());
+  EXPECT_EQ(0.5, heap_model.weights[0]);
+  ASSERT_EQ(7, heap_model.split_features.size());
+  ASSERT_EQ(7, heap_model.split_values.size());
+  ASSERT_EQ(8, heap_model.leaf_labels.size());
+  EXPECT_EQ(tree[0].split_feature, heap_model.split_features[0]);
+  EXPECT_EQ(tree[0].split_value, heap_model.split_values[0]);
+  for (const Example& example : examples_) {
+    int slot = 0;
+    for (int level = 0; level < heap_model.depth; ++level) {
+      slot = 2 * slot + 1 +
+             !(example.values[heap_model.split_features[slot]] <=
+               heap_model.split_values[slot]);
+    }
+    EXPECT_EQ(ClassifyExample(example, tree),
+              heap_model.leaf_labels[slot - 7]);
+  }
+}
+
 TEST_F(TreeTest, TestEvaluateTreeWgtd) {
   FLAGS_beta = 0;
   FLAGS_lambda = 0;
   FLAGS_tree_depth = 1;
-  Tree tree = TrainTree(examples_);
-  EXPECT_NEAR(0.2, EvaluateTreeWgtd(examples_, tree), kTolerance);
+  Tree tree = TrainTree(Context(data_), data_);
+  EXPECT_NEAR(0.2, EvaluateTreeWgtd(data_, tree), kTolerance);
+}
+
+TEST_F(TreeTest, TestEvaluateTreeWgtdIncorrectSet) {
+  FLAGS_beta = 0;
+  FLAGS_lambda = 0;
+  FLAGS_tree_depth = 1;
+  Tree tree = TrainTree(Context(data_), data_);
+  ExampleSet incorrect;
+  MakeIncorrectSet(data_, tree, &incorrect);
+  // Only example 3 is misclassified.
+  ASSERT_EQ(1, incorrect.size());
+  EXPECT_EQ(uint64_t{1} << 3, incorrect[0]);
+  EXPECT_EQ(EvaluateTreeWgtd(data_, tree),
+            EvaluateTreeWgtd(incorrect, data_.weights));
+
+  // More than one word of examples, with non-uniform weights.
+  vector<Example> examples(150);
+  for (size_t i = 0; i < examples.size(); ++i) {
+    examples[i].values = {static_cast<Value>(i % 13)};
+    examples[i].label = (i % 13 < 6) != (i % 7 == 0) ? 1 : -1;
+    examples[i].weight = (1 + i % 9) / 750.0;
+  }
+  ColumnarDataset data;
+  MakeColumnarDataset(examples, &data);
+  tree = TrainTree(Context(data), data);
+  MakeIncorrectSet(data, tree, &incorrect);
+  ASSERT_EQ(3, incorrect.size());
+  EXPECT_EQ(EvaluateTreeWgtd(data, tree),
+            EvaluateTreeWgtd(incorrect, data.weights));
+  EXPECT_LT(0, EvaluateTreeWgtd(incorrect, data.weights));
 }
@@ -17,23 +17,33 @@ limitations under the License.
 #ifndef TYPES_H_
 #define TYPES_H_
 
+#include <stdint.h>
+
 #include <map>
+#include <memory>
+#include <string>
 #include <vector>
 
 using std::map;
 using std::pair;
+using std::string;
 using std::vector;
 
 // Used in many places as the minimum possible difference between two distinct
 // numbers. Helps make code stable, tests predictable, etc.
 static const float kTolerance = 1e-6;
 
+typedef int ExampleId;
 typedef int Feature;
 typedef int Label;
 typedef int NodeId;
 typedef float Value;
 typedef float Weight;
 
+// A set of examples of a dataset: example id is in the set if bit id % 64 of
+// word id / 64 is set.
+typedef vector<uint64_t> ExampleSet;
+
 // An example consists of a vector of feature values, a label and a weight.
 // Note that this is a dense feature representation; the value of every
 // feature is contained in the vector, listed in a canonical order.
@@ -43,9 +53,93 @@ typedef struct Example {
   Weight weight;
 } Example;
 
-// A tree node.
+// A set of examples stored column by column, for training. The values of each
+// feature are contiguous, so scanning one feature across many examples reads
+// memory sequentially, and labels and weights are kept in arrays of their own.
+typedef struct ColumnarDataset {
+  int num_examples;
+  int num_features;
+  // (*values)[feature * num_examples + id] is example id's value of feature.
+  // Copies of a dataset share its values, so that each model trained on it can
+  // have example weights of its own without copying the values.
+  std::shared_ptr<const vector<Value>> values;
+  vector<Label> labels;
+  vector<Weight> weights;
+
+  const Value* column(Feature feature) const {
+    return &(*values)[static_cast<size_t>(feature) * num_examples];
+  }
+  Value value(ExampleId id, Feature feature) const {
+    return (*values)[static_cast<size_t>(feature) * num_examples + id];
+  }
+} ColumnarDataset;
+
+// A set of examples stored row by row, for scoring many of them at once. Unlike
+// a vector of Examples, the values of all examples are in one array.
+typedef struct FeatureMatrix {
+  int num_rows;
+  int num_features;
+  // values[row * num_features + feature] is the value of feature of the
+  // example in row.
+  vector<Value> values;
+
+  const Value* row(int row) const {
+    return &values[static_cast<size_t>(row) * num_features];
+  }
+} FeatureMatrix;
+
+// An index over the columns (features) of a set of training examples that
+// speeds up split search. It depends only on feature values, which never change
+// during training, so it is built once per data set.
+typedef struct ColumnIndex {
+  // sorted_ids[feature] holds the ids (positions in the training set) of all
+  // examples, sorted by increasing value of feature. Examples with equal values
+  // appear in training set order.
+  // Filled in only when split_mode is exact.
+  vector<vector<ExampleId>> sorted_ids;
+
+  // Filled in only when split_mode is histogram. Every feature's values are
+  // quantized into at most max_bins bins. bins[id * num_features + feature] is
+  // the bin of example id's value of feature. bin_values[feature][bin] is the
+  // largest value of feature in bin, so splitting after bin sends the examples
+  // with values <= bin_values[feature][bin] to the left child. The bins of
+  // feature occupy entries bin_offsets[feature] to bin_offsets[feature + 1] - 1
+  // of a Histogram. Training reads only the bins, so the values of the data
+  // set can be dropped once the index is built; see DropBinnedValues().
+  int num_features;
+  vector<uint8_t> bins;
+  vector<vector<Value>> bin_values;
+  vector<int> bin_offsets;
+} ColumnIndex;
+
+// The examples at some node that fall into one bin of one feature.
+typedef struct HistogramBin {
+  Weight positive_weight;  // Total weight of positive examples.
+  Weight negative_weight;  // Total weight of negative examples.
+  int num_examples;
+} HistogramBin;
+
+// The bins of every feature, among the examples at some node. See ColumnIndex
+// for the layout.
+typedef vector<HistogramBin> Histogram;
+
+// A node of a trained tree. Holds only what is needed to classify examples, so
+// that the size of a tree does not depend on the data it was trained on.
 typedef struct Node {
-  vector<Example> examples;  // Examples at this node.
+  Feature split_feature;  // Split feature.
+  Value split_value;  // Split value.
+  NodeId left_child_id;  // Pointer to left child, if any.
+  NodeId right_child_id;  // Pointer to right child, if any.
+  Label label;  // Label predicted by this node, if it is a leaf.
+  bool leaf;  // Is this node is a leaf?
+} Node;
+
+// A tree node while the tree is being trained.
+typedef struct TrainingNode {
+  // The examples at this node are those with ids example_ids[begin], ...,
+  // example_ids[end - 1] of the ExamplePartition of the tree being trained.
+  int begin;
+  int end;
   Feature split_feature;  // Split feature.
   Value split_value;  // Split value.
   NodeId left_child_id;  // Pointer to left child, if any.
@@ -54,13 +148,66 @@ typedef struct Node {
   Weight negative_weight;  // Total weight of negative examples at this node.
   bool leaf;  // Is this node is a leaf?
   int depth;  // Depth of the node in the tree. Root node has depth 0.
-} Node;
+} TrainingNode;
+
+// While a tree is trained, the ids of the training examples are kept in one
+// array that is partitioned in place every time a node is split, so that the
+// examples at every node occupy a contiguous range of it.
+typedef struct ExamplePartition {
+  vector<ExampleId> example_ids;
+  // example_node[id] is the node that example id currently belongs to.
+  vector<NodeId> example_node;
+  // Used while splitting a node, so that splitting allocates nothing.
+  vector<ExampleId> scratch;
+  // Filled in by SortPartition(), in exact split mode. The examples at a node
+  // are sorted_ids[feature][begin], ..., sorted_ids[feature][end - 1], sorted
+  // by value of feature, with equal values in training set order, so that the
+  // split search at a node only reads the examples at the node.
+  vector<vector<ExampleId>> sorted_ids;
+} ExamplePartition;
 
 // A tree is a vector of nodes.
 typedef vector<Node> Tree;
 
+// A node of a tree laid out for classifying examples, in 12 bytes. The two
+// children of a node are next to each other, so one child id is enough, and a
+// leaf holds its label in place of the split value.
+typedef struct PackedNode {
+  Feature split_feature;  // Split feature, or -1 if the node is a leaf.
+  Value split_value;  // Split value, or label if the node is a leaf.
+  NodeId left_child_id;  // The right child is left_child_id + 1.
+} PackedNode;
+
+// A tree being trained. Converted to a Tree once training is done.
+typedef vector<TrainingNode> TrainingTree;
+
 // A model is a vector of (weight, tree) pairs, i.e., a weighted combination of
 // trees.
 typedef vector<pair<Weight, Tree>> Model;
 
+// The trees of a model, packed one after the other into one array for
+// classifying examples. Tree i of the model has weight weights[i] and root
+// nodes[roots[i]], and its child ids are relative to its root.
+typedef struct PackedModel {
+  vector<Weight> weights;
+  vector<int> roots;
+  vector<PackedNode> nodes;
+} PackedModel;
+
+// The trees of a model laid out as complete binary trees of the same depth, in
+// heap order: the children of slot s are slots 2s + 1 and 2s + 2, the first
+// 2^depth - 1 slots hold splits and the last 2^depth hold leaves. Every
+// example then takes exactly depth steps to reach a leaf. A leaf of a tree
+// above the bottom level is padded: its slot becomes a split that sends every
+// example left, and every leaf slot below it holds its label.
+typedef struct HeapModel {
+  int depth;
+  vector<Weight> weights;
+  // Split slot s of tree i is entry i * (2^depth - 1) + s.
+  vector<Feature> split_features;
+  vector<Value> split_values;
+  // Leaf slot 2^depth - 1 + s of tree i is entry i * 2^depth + s.
+  vector<Value> leaf_labels;
+} HeapModel;
+
 #endif  // TYPES_H_